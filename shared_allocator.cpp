@@ -1,23 +1,59 @@
 #include "shared_allocator.h"
 #include <semaphore.h>
+#include <atomic>
 #include <stdexcept>
 #include <system_error>
 #include <string>
+#include <optional>
+#include <exception>
+#include <utility>
+#include <algorithm>
+#include <vector>
+#include <thread>
 #include <string.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <linux/userfaultfd.h>
+#include <sys/syscall.h>
 
 using namespace std;
 
 string global_shared_allocator::name_ = to_string(getpid()) + ".shm";;
 int global_shared_allocator::shmfd_ = -1;
 int global_shared_allocator::oflag_;
+global_shared_allocator::backing global_shared_allocator::backing_;
 global_shared_allocator::driver *global_shared_allocator::driver_;
 
 static system_error make_system_error(const string &what) { return {errno, system_category(), what}; }
 
+// Copy the first n bytes of `in` to `out` without passing them through user space.
+static void copy_fd(int out, int in, size_t n)
+{
+  off_t off_in = 0, off_out = 0;
+  bool range = true;  // copy_file_range() refuses some file system pairs
+  while(n) {
+    ssize_t r = range ? copy_file_range(in, &off_in, out, &off_out, n, 0) : sendfile(out, in, &off_in, n);
+    if(r < 0 && range && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+      range = false;
+      if(lseek(out, off_out, SEEK_SET) < 0) throw make_system_error("lseek");
+      continue;
+    }
+    if(r < 0 && errno == EINTR) continue;
+    if(r < 0) throw make_system_error(range ? "copy_file_range" : "sendfile");
+    if(r == 0) throw runtime_error("copy_fd: unexpected end of file");
+    n -= r;
+  }
+}
+
 class global_shared_allocator::driver {
 public:
   // Map shared memory and create/find the driver at the beginning.
@@ -26,21 +62,44 @@ public:
   // Destroy/discard the driver and unmap shared memory.
   static void destroy();
 
+  // Reset process-shared state left by earlier runs. Nobody else may be attached.
+  void recover();
+
+  void flush(const void *p, size_t n);
+  void checkpoint(int fd);
+  void *root() const { return root_.load(); }
+  void set_root(void *p) { root_.store(p); }
+  void *addr() const { return addr_; }
+  size_t size() const { return size_.load(); }
+
   void *allocate(size_t n);
   void deallocate(void *p, size_t n);
+  size_t usable_size(const void *p);
+
+  // Epoch-based reclamation.
+  void epoch_enter(), epoch_leave();
+  void retire(void *p);
+  void reclaim();
+  void synchronize();
 
 private:
   driver(size_t size);
   ~driver() noexcept(false);
 
   // Semaphores may support inter-process better than pthreads.
-  sem_t sem_;
+  // Lock order: heap_sem_ -> bin_[0].sem_ -> bin_[1].sem_ -> ...
+  // Coalescing only happens under heap_sem_; binned chunks look allocated to it.
+  sem_t heap_sem_;  // large objects: free_list_ and coalescing
 
   // Mapping address of the shared memory. It must be the same among sharing processes.
   void *addr_;
 
-  // Allocated (truncated) in-memory-file size.
-  size_t size_;
+  // High-water mark of the in-memory-file size, raised by extend() under heap_sem_.
+  // The file always covers size_ bytes, and chunks cover them under heap_sem_.
+  std::atomic<size_t> size_;
+
+  // See global_shared_allocator::root().
+  std::atomic<void *> root_;
 
   // The size limit is considered acceptable for typical cases.
   // A larger size setting can cause a `mmap()` failure on some systems.
@@ -58,6 +117,10 @@ private:
   // Take #bits of `size_t` as the number of free lists.
   static inline constexpr size_t n_free_list_ = sizeof(size_t) << 3;
 
+  // Small chunks are recycled through exact-size bins without coalescing.
+  static inline constexpr size_t n_bin_ = 16;
+  static inline constexpr size_t max_bin_size_ = n_bin_ * data_align_;
+
   // In-place memory management.
   struct chunk;
 
@@ -99,28 +162,76 @@ private:
     chunk *coalesce();
   } free_list_[n_free_list_];  // dummy head
 
+  // Singly linked through footer()->next_, footer()->size_ is kept 0.
+  struct bin {
+    sem_t sem_;
+    chunk *head_;
+  } bin_[n_bin_];
+
   // The addition is safe as the two pars are the same aligned.
   static inline constexpr size_t min_chunk_size_ = sizeof(chunk) + min_data_size_;
 
   // Underlying linear memory management.
-  static int map_prot();
-  chunk *extend(size_t size);
+  void *extend(size_t reqsize, size_t size);  // NULL if size_ != size
+
+  // Free list and bin management.
+  static size_t bin_index(size_t size) { return size / data_align_ - 1; }
+  void *carve(size_t reqsize);  // heap_sem_ held
+  void consolidate();  // heap_sem_ held
+
+  // A thread announces the global epoch in its reader slot while it is inside.
+  // Memory retired at epoch e is freed once every announced epoch exceeds e.
+  // Only whoever takes a slot over by a CAS on tid_ may clear epoch_ of a dead owner.
+  struct reader {
+    std::atomic<pid_t> tid_;  // owner thread, 0 if free, -1 while being freed
+    std::atomic<uint64_t> epoch_;  // 0 outside
+  };
+
+  // Slots are allocated from the heap to keep the driver within a page.
+  static inline constexpr size_t n_reader_ = 1024;
+
+  // reclaim() is attempted by retire() every so many blocks.
+  static inline constexpr size_t reclaim_period_ = 64;
+
+  std::atomic<uint64_t> epoch_;
+  reader *readers_;
+  // Readers may still use the payload of retired chunks. They are linked through footer()->next_
+  // and remember the retirement epoch in header()->prev_, both unused while allocated.
+  sem_t retire_sem_;  // retired_ and n_retired_
+  chunk *retired_;
+  size_t n_retired_;
+
+  reader *own_reader();
+  uint64_t min_epoch();  // of threads inside, UINT64_MAX if none
+  static bool alive(pid_t tid);
+  static void release(reader &r, pid_t dead);  // unless taken over meanwhile
 
   // Concurrence control.
   struct lock {
-    lock() { if(sem_wait(&driver_->sem_)) throw make_system_error("sem_wait"); }
-    ~lock() noexcept(false) { if(sem_post(&driver_->sem_)) throw make_system_error("sem_post"); }
+    sem_t *sem_;
+    lock(sem_t &sem) : sem_(&sem) { if(sem_wait(sem_)) throw make_system_error("sem_wait"); }
+    ~lock() noexcept(false) { if(sem_post(sem_)) throw make_system_error("sem_post"); }
   };
 
 } __attribute__((aligned(data_align_)));  // This makes &driver_[1] a safe address of the first chunk.
 
 void *global_shared_allocator::allocate(size_t n) { return driver_->allocate(n); }
 void global_shared_allocator::deallocate(void *p, size_t n) { return driver_->deallocate(p, n); }
+size_t global_shared_allocator::usable_size(const void *p) { return driver_->usable_size(p); }
+void global_shared_allocator::epoch_enter() { driver_->epoch_enter(); }
+void global_shared_allocator::epoch_leave() { driver_->epoch_leave(); }
+void global_shared_allocator::retire(void *p, size_t) { driver_->retire(p); }
+void global_shared_allocator::reclaim() { driver_->reclaim(); }
+void global_shared_allocator::synchronize() { driver_->synchronize(); }
+void global_shared_allocator::flush(const void *p, size_t n) { driver_->flush(p, n); }
+void *global_shared_allocator::root() { return driver_->root(); }
+void global_shared_allocator::set_root(void *p) { driver_->set_root(p); }
 
 const char *global_shared_allocator::shm_open(const char *name, int oflag, mode_t mode)
 {
   if(driver_) throw logic_error("duplicate call to "s + __func__);
   if(name) name_ = name;
+  backing_ = shm_backed;
   oflag_ = oflag;
   shmfd_ = ::shm_open(name_.c_str(), oflag_, mode);
   if(shmfd_ < 0) throw make_system_error("shm_open");
@@ -129,10 +240,422 @@ const char *global_shared_allocator::shm_open(const char *name, int oflag, mode_
   return shm_name();
 }
 
+const char *global_shared_allocator::memfd_open(const char *name, unsigned flags)
+{
+  if(driver_) throw logic_error("duplicate call to "s + __func__);
+  if(name) name_ = name;
+  backing_ = memfd_backed;
+  oflag_ = O_RDWR | O_CREAT | O_TRUNC;
+  shmfd_ = memfd_create(name_.c_str(), MFD_CLOEXEC | MFD_ALLOW_SEALING | flags);
+  if(shmfd_ < 0) throw make_system_error("memfd_create");
+  driver::create();
+  return shm_name();
+}
+
+void global_shared_allocator::fd_open(int fd, int oflag)
+{
+  if(driver_) throw logic_error("duplicate call to "s + __func__);
+  // A memfd created with MFD_ALLOW_SEALING can be published. Names of others are unknown.
+  int seals = fcntl(fd, F_GET_SEALS);
+  backing_ = seals >= 0 && !(seals & F_SEAL_SEAL) ? memfd_backed : fd_backed;
+  oflag_ = oflag;
+  shmfd_ = fd;
+  driver::create();
+}
+
+// The path of our descriptor `fd` as seen by other processes.
+static string proc_fd(int fd)
+{
+  return "/proc/" + to_string(getpid()) + "/fd/" + to_string(fd);
+}
+
+shared_snapshot global_shared_allocator::publish(const char *path)
+{
+  if(!driver_ || backing_ != memfd_backed) throw logic_error("invalid call to "s + __func__);
+
+  // Writable mappings must be gone before sealing. The heap is kept as is.
+  size_t size = driver_->size();
+  oflag_ &= ~O_TRUNC;
+  driver::destroy();
+  int fd = shmfd_;
+  shmfd_ = -1;
+  oflag_ = 0;
+  try {
+    if(ftruncate(fd, size)) throw make_system_error("ftruncate");  // drop what extend() lost
+    if(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) throw make_system_error("F_ADD_SEALS");
+  } catch(...) {
+    close(fd);
+    throw;
+  }
+  shared_snapshot snapshot(fd);
+
+  if(path) {
+    string tmp = path + ".tmp"s;
+    ::unlink(tmp.c_str());
+    if(symlink(proc_fd(fd).c_str(), tmp.c_str())) throw make_system_error("symlink");
+    if(rename(tmp.c_str(), path)) throw make_system_error("rename");
+    snapshot.link_ = path;
+  }
+  return snapshot;
+}
+
+shared_snapshot::shared_snapshot(int fd) : fd_(fd), addr_(NULL), size_(0)
+{
+  typedef global_shared_allocator::driver driver;
+  struct closer {
+    shared_snapshot *s;
+    ~closer() { if(s && s->fd_ >= 0) close(s->fd_); }
+  } c{this};
+
+  // Immutability is what makes lock-free reading safe, so insist on it.
+  int seals = fcntl(fd_, F_GET_SEALS);
+  if(seals < 0) throw make_system_error("F_GET_SEALS");
+  if(!(seals & F_SEAL_WRITE) || !(seals & F_SEAL_SHRINK)) throw runtime_error("shared_snapshot: segment not sealed");
+  struct stat st;
+  if(fstat(fd_, &st)) throw make_system_error("fstat");
+  size_ = st.st_size;
+  if(size_ < sizeof(driver)) throw runtime_error("shared_snapshot: segment too small");
+
+  // Find the address from the driver, then map there.
+  void *p = mmap(NULL, sizeof(driver), PROT_READ, MAP_SHARED, fd_, 0);
+  if(p == MAP_FAILED) throw make_system_error("mmap");
+  void *hint = ((driver *)p)->addr();
+  munmap(p, sizeof(driver));
+  addr_ = mmap(hint, size_, PROT_READ, MAP_SHARED | MAP_FIXED_NOREPLACE, fd_, 0);
+  if(addr_ != hint) {
+    if(addr_ != MAP_FAILED) munmap(addr_, size_);  // kernels without MAP_FIXED_NOREPLACE
+    addr_ = NULL;
+    throw make_system_error("mmap");
+  }
+  c.s = NULL;
+}
+
+static int open_snapshot(const char *path)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0) throw make_system_error("open");
+  return fd;
+}
+
+shared_snapshot::shared_snapshot(const char *path) : shared_snapshot(open_snapshot(path)) { }
+
+shared_snapshot &shared_snapshot::operator=(shared_snapshot &&s)
+{
+  if(this != &s) {
+    this->~shared_snapshot();
+    new(this) shared_snapshot(std::move(s));
+  }
+  return *this;
+}
+
+shared_snapshot::~shared_snapshot()
+{
+  // The descriptor number is reused after closing: readers must not follow the link to another file.
+  if(!link_.empty()) {
+    string target = proc_fd(fd_);
+    char buf[64];
+    ssize_t n = readlink(link_.c_str(), buf, sizeof buf);
+    if(n == (ssize_t)target.size() && memcmp(buf, target.data(), n) == 0) ::unlink(link_.c_str());
+  }
+  if(addr_) munmap(addr_, size_);
+  if(fd_ >= 0) close(fd_);
+}
+
+void *shared_snapshot::root() const
+{
+  return ((const global_shared_allocator::driver *)addr_)->root();
+}
+
+// Lock the whole file for the open file description, as flock() does, waiting if asked to.
+static int lock_file(int fd, short type, bool wait)
+{
+  struct flock l = {};
+  l.l_type = type;
+  l.l_whence = SEEK_SET;
+  int r;
+  while((r = fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &l)) && errno == EINTR) { }
+  return r;
+}
+
+const char *global_shared_allocator::file_open(const char *path, int oflag, mode_t mode)
+{
+  if(driver_) throw logic_error("duplicate call to "s + __func__);
+  name_ = path;
+  backing_ = file_backed;
+  shmfd_ = ::open(path, oflag | O_CLOEXEC, mode);
+  if(shmfd_ < 0) throw make_system_error("open");
+
+  // Every attached process holds a shared lock. Whoever gets it exclusively is alone and
+  // recovers the segment before downgrading; the others block until then. Unlike flock(),
+  // open file description locks are converted atomically, so nobody else can take the
+  // exclusive lock while it is being downgraded.
+  bool alone = lock_file(shmfd_, F_WRLCK, false) == 0;
+  if(!alone && ((errno != EAGAIN && errno != EACCES) || lock_file(shmfd_, F_RDLCK, true))) throw make_system_error("F_OFD_SETLK");
+  struct stat st;
+  if(fstat(shmfd_, &st)) throw make_system_error("fstat");
+  if(st.st_size == 0) {
+    if(!alone) throw runtime_error("file_open: "s + path + " is being initialized");
+    oflag |= O_TRUNC;
+  }
+  oflag_ = oflag;
+  driver::create();
+  if(!(oflag_ & O_TRUNC)) {
+    if(alone) driver_->recover();
+    // Start reading the file in so that warm restart is bounded by sequential I/O.
+    madvise(driver_, st.st_size, MADV_WILLNEED);
+  }
+  if(alone && lock_file(shmfd_, F_RDLCK, false)) throw make_system_error("F_OFD_SETLK");
+  return shm_name();
+}
+
+void global_shared_allocator::checkpoint(const char *path)
+{
+  if(!driver_) throw logic_error("invalid call to "s + __func__);
+  restore_wait();  // pages not yet restored would read as zeros
+  string tmp = path + ".tmp"s;
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if(fd < 0) throw make_system_error("open");
+  try {
+    driver_->checkpoint(fd);
+    if(fsync(fd)) throw make_system_error("fsync");
+  } catch(...) {
+    close(fd);
+    ::unlink(tmp.c_str());
+    throw;
+  }
+  close(fd);
+  if(rename(tmp.c_str(), path)) throw make_system_error("rename");
+}
+
+const char *global_shared_allocator::restore(const char *path, const char *name, mode_t mode)
+{
+  if(driver_) throw logic_error("duplicate call to "s + __func__);
+  int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+  if(fd < 0) throw make_system_error("open");
+  if(name) name_ = name;
+  backing_ = shm_backed;
+  int shm = -1;
+  try {
+    struct stat st;
+    if(fstat(fd, &st)) throw make_system_error("fstat");
+    shm = ::shm_open(name_.c_str(), O_RDWR | O_CREAT | O_TRUNC, mode);
+    if(shm < 0) throw make_system_error("shm_open");
+    copy_fd(shm, fd, st.st_size);
+  } catch(...) {
+    close(fd);
+    if(shm >= 0) {  // half-written, so nobody may attach to it
+      close(shm);
+      ::shm_unlink(name_.c_str());
+    }
+    throw;
+  }
+  close(fd);
+  shmfd_ = shm;
+
+  // Attach at the stored address, then take over as the master.
+  oflag_ = O_RDWR;
+  driver::create();
+  driver_->recover();
+  oflag_ |= O_CREAT | O_TRUNC;
+  return shm_name();
+}
+
+// Process-local state of restore_lazy(). Never destroyed, so a running thread is harmless at exit.
+static struct lazy_restore {
+  int uffd, fd;  // userfaultfd, checkpoint
+  char *base;
+  size_t size, n_page, page;
+  string hot;  // list of pages touched first, for the next restore
+  std::atomic<bool> stop;
+  std::thread thread;
+  exception_ptr error;  // for restore_wait()
+
+  void run();
+  void serve();
+  bool copy(size_t first, size_t n, vector<bool> &present, char *buf);
+  void close_fds();
+} *lazy;
+
+const char *global_shared_allocator::restore_lazy(const char *path, const char *name, mode_t mode)
+{
+  if(driver_) throw logic_error("duplicate call to "s + __func__);
+  int uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  uffdio_api api = {UFFD_API, 0, 0};
+  if(uffd >= 0 && (ioctl(uffd, UFFDIO_API, &api) || !(api.features & UFFD_FEATURE_MISSING_SHMEM))) {
+    close(uffd);
+    uffd = -1;
+  }
+  if(uffd < 0) return restore(path, name, mode);
+
+  if(name) name_ = name;
+  backing_ = shm_backed;
+  int fd = -1, shm = -1;
+  struct stat st;
+  size_t page = getpagesize();
+  try {
+    fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) throw make_system_error("open");
+    if(fstat(fd, &st)) throw make_system_error("fstat");
+    shm = ::shm_open(name_.c_str(), O_RDWR | O_CREAT | O_TRUNC, mode);
+    if(shm < 0) throw make_system_error("shm_open");
+    if(ftruncate(shm, st.st_size)) throw make_system_error("ftruncate");
+    // Only the driver is needed to map; everything else is copied on demand.
+    copy_fd(shm, fd, page);
+  } catch(...) {
+    close(uffd);
+    if(fd >= 0) close(fd);
+    if(shm >= 0) {  // as in restore()
+      close(shm);
+      ::shm_unlink(name_.c_str());
+    }
+    throw;
+  }
+  shmfd_ = shm;
+  oflag_ = O_RDWR;
+  driver::create();
+  delete lazy;  // joined by shm_close()
+  lazy = new lazy_restore{uffd, fd, (char *)driver_, (size_t)st.st_size, (st.st_size + page - 1) / page, page, path + ".hot"s, {false}, {}, {}};
+  uffdio_register reg = {{(uintptr_t)driver_, lazy->n_page * page}, UFFDIO_REGISTER_MODE_MISSING, 0};
+  if(ioctl(uffd, UFFDIO_REGISTER, &reg)) throw make_system_error("UFFDIO_REGISTER");
+  lazy->thread = std::thread(&lazy_restore::run, lazy);
+
+  driver_->recover();
+  oflag_ |= O_CREAT | O_TRUNC;
+  return shm_name();
+}
+
+void global_shared_allocator::restore_wait()
+{
+  if(lazy && lazy->thread.joinable()) lazy->thread.join();
+  if(lazy && lazy->error) rethrow_exception(exchange(lazy->error, nullptr));
+}
+
+void lazy_restore::run()
+{
+  try {
+    serve();
+  } catch(...) {
+    // Pages stay registered: faulting threads block until shm_close() instead of reading zeros.
+    error = current_exception();
+  }
+}
+
+// Serve faults first, then prefetch a batch, until every page is present.
+void lazy_restore::serve()
+{
+  size_t batch = 64;
+  vector<bool> present(n_page);
+  present[0] = true;
+  vector<char> buf(batch * page);
+  vector<uint64_t> touched;
+
+  // Prefetch order: hot pages of the last run, then all pages.
+  vector<uint64_t> order;
+  if(int h = ::open(hot.c_str(), O_RDONLY | O_CLOEXEC); h >= 0) {
+    struct stat st;
+    if(fstat(h, &st) == 0) {
+      order.resize(st.st_size / sizeof(uint64_t));
+      if(pread(h, order.data(), order.size() * sizeof(uint64_t), 0) != (ssize_t)(order.size() * sizeof(uint64_t))) order.clear();
+    }
+    close(h);
+  }
+  size_t next_hot = 0, next_seq = 0;
+
+  while(!stop.load()) {
+    pollfd pfd = {uffd, POLLIN, 0};
+    while(poll(&pfd, 1, 0) > 0) {
+      // A fault may be resolved by our prefetch between poll() and read().
+      uffd_msg msg;
+      ssize_t r = read(uffd, &msg, sizeof msg);
+      if(r < 0 && errno == EAGAIN) break;
+      if(r != sizeof msg || msg.event != UFFD_EVENT_PAGEFAULT) continue;
+      size_t i = (msg.arg.pagefault.address - (uintptr_t)base) / page;
+      touched.push_back(i);
+      if(!copy(i, 1, present, buf.data())) {  // already there: just wake the faulting thread
+        uffdio_range r = {(uintptr_t)base + i * page, page};
+        ioctl(uffd, UFFDIO_WAKE, &r);
+      }
+    }
+
+    // The next run of absent pages, at most a batch.
+    size_t first = n_page;
+    while(next_hot < order.size() && first == n_page) {
+      size_t i = order[next_hot++];
+      if(i < n_page && !present[i]) first = i;
+    }
+    while(first == n_page && next_seq < n_page) {
+      if(!present[next_seq]) first = next_seq;
+      ++next_seq;
+    }
+    if(first == n_page) break;
+    size_t n = 1;
+    while(n < batch && first + n < n_page && !present[first + n]) ++n;
+    copy(first, n, present, buf.data());
+  }
+
+  bool complete = !stop.load();
+  uffdio_range r = {(uintptr_t)base, n_page * page};
+  ioctl(uffd, UFFDIO_UNREGISTER, &r);
+  close_fds();
+  if(complete && !touched.empty()) {
+    string tmp = hot + ".tmp";
+    int h = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(h >= 0) {
+      bool ok = write(h, touched.data(), touched.size() * sizeof(uint64_t)) == (ssize_t)(touched.size() * sizeof(uint64_t));
+      close(h);
+      if(!ok || rename(tmp.c_str(), hot.c_str())) ::unlink(tmp.c_str());
+    }
+  }
+}
+
+void lazy_restore::close_fds()
+{
+  if(uffd >= 0) close(uffd);
+  if(fd >= 0) close(fd);
+  uffd = fd = -1;
+}
+
+// Returns false if some page was already present.
+bool lazy_restore::copy(size_t first, size_t n, vector<bool> &present, char *buf)
+{
+  // Only the tail of the last page lies past the end of the checkpoint.
+  size_t got = 0, want = min(n * page, size - first * page);
+  while(got < want) {
+    ssize_t r = pread(fd, buf + got, want - got, first * page + got);
+    if(r < 0 && errno == EINTR) continue;
+    if(r < 0) throw make_system_error("pread");
+    if(r == 0) throw runtime_error("restore_lazy: checkpoint truncated");
+    got += r;
+  }
+  memset(buf + got, 0, n * page - got);
+  uffdio_copy c = {(uintptr_t)base + first * page, (uintptr_t)buf, n * page, 0, 0};
+  if(ioctl(uffd, UFFDIO_COPY, &c) == 0) {
+    for(size_t i = 0; i < n; ++i) present[first + i] = true;
+    return true;
+  }
+
+  // Some page appeared in the meantime (or we raced a mapping change): go page by page.
+  bool all = true;
+  for(size_t i = 0; i < n; ++i) {
+    uffdio_copy p = {(uintptr_t)base + (first + i) * page, (uintptr_t)buf + i * page, page, 0, 0};
+    int r;
+    while((r = ioctl(uffd, UFFDIO_COPY, &p)) && errno == EAGAIN) p.copy = 0;
+    if(r && errno != EEXIST) throw make_system_error("UFFDIO_COPY");
+    if(r) all = false;
+    present[first + i] = true;
+  }
+  return all;
+}
+
 void global_shared_allocator::shm_close()
 {
   if(!driver_) throw logic_error("invalid call to "s + __func__);
+  if(lazy && lazy->thread.joinable()) {  // leave the rest of the restore
+    lazy->stop.store(true);
+    lazy->thread.join();
+  }
   driver::destroy();
+  if(lazy) lazy->close_fds();  // left open by a failed restore
   close(shmfd_);
   shmfd_ = -1;
   oflag_ = 0;
@@ -140,6 +663,11 @@ void global_shared_allocator::shm_close()
 
 void global_shared_allocator::shm_unlink()
 {
+  if(backing_ == memfd_backed) return;
+  if(backing_ == file_backed) {
+    if(::unlink(name_.c_str())) throw make_system_error("unlink");
+    return;
+  }
   if(::shm_unlink(name_.c_str())) throw make_system_error("shm_unlink");
 }
 
@@ -150,25 +678,42 @@ mode_t global_shared_allocator::shm_mode()
   return st.st_mode;
 }
 
+int global_shared_allocator::shm_prot()
+{
+  int prot = PROT_READ;
+  if(oflag_ & O_WRONLY) prot &= ~PROT_READ;
+  if(oflag_ & O_RDWR) prot |= PROT_WRITE;
+  return prot;
+}
+
 void global_shared_allocator::driver::create()
 {
   static_assert(sizeof(driver) <= min_size_);
+  static_assert(std::atomic<size_t>::is_always_lock_free);
+  static_assert(std::atomic<uint64_t>::is_always_lock_free);
 
   // Get original shared memory size.
   struct stat st;
   if(fstat(shmfd_, &st)) throw make_system_error("fstat");
   size_t size = st.st_size;
 
-  // Allocate at least min_size_ bytes.
+  // Allocate at least min_size_ bytes, in whole pages of the file (huge pages for hugetlbfs).
+  // extend() keeps doubling the size, so it stays a multiple.
+  size_t grain = max<size_t>(min_size_, st.st_blksize);
   if(size > max_size_) throw logic_error("shared memory too large: "s + to_string(size) + " bytes");
-  if(size < min_size_) {
-    if(ftruncate(shmfd_, min_size_)) throw make_system_error("ftruncate");
-    size = min_size_;
+  if(size < grain) {
+    if(int e = posix_fallocate(shmfd_, 0, grain)) {  // allocated like in extend()
+      errno = e;
+      throw make_system_error("posix_fallocate");
+    }
+    size = grain;
   }
 
   // Map shared memory.
   // max_size_ bytes are mapped for safety consideration. See man mmap(2).
-  void *addr = mmap(NULL, max_size_, map_prot(), MAP_SHARED, shmfd_, 0);
+  // Nothing is reserved for them: extend() allocates the whole of each range it adds, even in
+  // huge pages, before any of it is used.
+  void *addr = mmap(NULL, max_size_, shm_prot(), MAP_SHARED | MAP_NORESERVE, shmfd_, 0);
   if(addr == MAP_FAILED) throw make_system_error("mmap");
 
   // Create driver at the beginning of the shared memory.
@@ -179,9 +724,10 @@ void global_shared_allocator::driver::create()
     // Make sure every process maps the same address.
     void *hint = driver_->addr_;
     if(hint != addr) {
-      if(munmap(addr, size)) throw make_system_error("munmap");
-      addr = mmap(hint, max_size_, map_prot(), MAP_SHARED | MAP_FIXED_NOREPLACE, shmfd_, 0);
+      if(munmap(addr, max_size_)) throw make_system_error("munmap");
+      addr = mmap(hint, max_size_, shm_prot(), MAP_SHARED | MAP_NORESERVE | MAP_FIXED_NOREPLACE, shmfd_, 0);
       if(addr != hint) throw make_system_error("mmap");
+      driver_ = (driver *)addr;
     }
   }
 }
@@ -198,17 +744,77 @@ void global_shared_allocator::driver::destroy()
 
 global_shared_allocator::driver::driver(size_t size)
 {
-  if(sem_init(&sem_, 1, 1)) throw make_system_error("sem_init");
+  if(sem_init(&heap_sem_, 1, 1)) throw make_system_error("sem_init");
+  for(bin &b : bin_) {
+    if(sem_init(&b.sem_, 1, 1)) throw make_system_error("sem_init");
+    b.head_ = NULL;
+  }
   addr_ = this;
   size_ = size;
+  root_ = NULL;
   memset(free_list_, 0, sizeof free_list_);
   size -= sizeof *this;
   if(size >= min_chunk_size_) chunk::add_chunk(&this[1], size);
+
+  epoch_ = 1;
+  if(sem_init(&retire_sem_, 1, 1)) throw make_system_error("sem_init");
+  retired_ = NULL;
+  n_retired_ = 0;
+  readers_ = (reader *)allocate(n_reader_ * sizeof(reader));
+  for(size_t i = 0; i < n_reader_; ++i) new(&readers_[i]) reader{{0}, {0}};
 }
 
 global_shared_allocator::driver::~driver() noexcept(false)
 {
-  if(sem_destroy(&sem_)) throw make_system_error("sem_destroy");
+  for(bin &b : bin_) {
+    if(sem_destroy(&b.sem_)) throw make_system_error("sem_destroy");
+  }
+  if(sem_destroy(&heap_sem_)) throw make_system_error("sem_destroy");
+  if(sem_destroy(&retire_sem_)) throw make_system_error("sem_destroy");
+}
+
+void global_shared_allocator::driver::recover()
+{
+  // Semaphores may have been held by processes that died.
+  if(sem_init(&heap_sem_, 1, 1)) throw make_system_error("sem_init");
+  for(bin &b : bin_) {
+    if(sem_init(&b.sem_, 1, 1)) throw make_system_error("sem_init");
+  }
+  if(sem_init(&retire_sem_, 1, 1)) throw make_system_error("sem_init");
+
+  // The file must cover the heap, e.g. if a checkpoint was cut short.
+  struct stat st;
+  if(fstat(shmfd_, &st)) throw make_system_error("fstat");
+  if((size_t)st.st_size < size_.load() && ftruncate(shmfd_, size_.load())) throw make_system_error("ftruncate");
+
+  // Thread ids of earlier runs mean nothing now, and no retired block is read any more.
+  for(size_t i = 0; i < n_reader_; ++i) {
+    readers_[i].tid_.store(0);
+    readers_[i].epoch_.store(0);
+  }
+  reclaim();
+}
+
+void global_shared_allocator::driver::checkpoint(int fd)
+{
+  // Quiesce the allocator so that the chunk tags and lists in the copy are consistent.
+  lock h(heap_sem_);
+  optional<lock> b[n_bin_];
+  for(size_t i = 0; i < n_bin_; ++i) b[i].emplace(bin_[i].sem_);
+  lock r(retire_sem_);
+
+  // extend() raises size_ only together with adding the space, under heap_sem_.
+  copy_fd(fd, shmfd_, size_.load());
+}
+
+void global_shared_allocator::driver::flush(const void *p, size_t n)
+{
+  uintptr_t begin = (uintptr_t)this, end = begin + size_.load();
+  if(p) {
+    begin = (uintptr_t)p & ~(uintptr_t)(getpagesize() - 1);
+    end = (uintptr_t)p + n;
+  }
+  if(msync((void *)begin, end - begin, MS_SYNC)) throw make_system_error("msync");
 }
 
 void *global_shared_allocator::driver::allocate(size_t size)
@@ -216,28 +822,232 @@ void *global_shared_allocator::driver::allocate(size_t size)
   if(size == 0) return NULL;
 
   size = (size + data_align_ - 1) & ~(data_align_ - 1);
-  lock l;
-  for(size_t i = chunk::list_index(size); i < n_free_list_; ++i) {
+  if(size <= max_bin_size_) {
+    bin &b = bin_[bin_index(size)];
+    lock l(b.sem_);
+    if(chunk *c = b.head_) {
+      b.head_ = c->footer()->next_;
+      c->footer()->next_ = NULL;
+      return c->data();
+    }
+  }
+  for(;;) {
+    size_t s;
+    {
+      lock l(heap_sem_);
+      if(void *p = carve(size)) return p;
+      consolidate();
+      if(void *p = carve(size)) return p;
+      s = size_.load();
+    }
+    // Locks are released while we are growing the segment.
+    if(void *p = extend(size, s)) return p;
+  }
+}
+
+void global_shared_allocator::driver::deallocate(void *p, size_t)
+{
+  if(!p) return;
+  chunk *c = chunk::get_chunk(p);
+  if(c->size() <= max_bin_size_) {
+    bin &b = bin_[bin_index(c->size())];
+    lock l(b.sem_);
+    c->footer()->next_ = b.head_;
+    b.head_ = c;
+    return;
+  }
+  lock l(heap_sem_);
+  c->deallocate();
+}
+
+// Per-thread state of epoch_enter()/epoch_leave(). Reset in fork children.
+static thread_local struct {
+  void *driver;  // whose slot is cached
+  void *reader;
+  unsigned nest;
+} epoch_local;
+static int epoch_local_reset = pthread_atfork(NULL, NULL, [] { epoch_local = {}; });
+
+void global_shared_allocator::driver::epoch_enter()
+{
+  (void)epoch_local_reset;
+  if(epoch_local.nest++) return;
+  reader *r = own_reader();
+
+  // The announcement must be visible before the protected pointers are loaded.
+  r->epoch_.store(epoch_.load());
+}
+
+void global_shared_allocator::driver::epoch_leave()
+{
+  if(epoch_local.nest == 0) throw logic_error("epoch_leave: not inside");
+  if(--epoch_local.nest) return;
+  ((reader *)epoch_local.reader)->epoch_.store(0, memory_order_release);
+}
+
+void global_shared_allocator::driver::retire(void *p)
+{
+  if(!p) return;
+  chunk *c = chunk::get_chunk(p);
+  c->header()->prev_ = (chunk *)(uintptr_t)epoch_.fetch_add(1);
+  bool full;
+  {
+    lock l(retire_sem_);
+    c->footer()->next_ = retired_;
+    retired_ = c;
+    full = ++n_retired_ % reclaim_period_ == 0;
+  }
+  if(full) reclaim();
+}
+
+void global_shared_allocator::driver::reclaim()
+{
+  uint64_t e = min_epoch();
+  chunk *ready = NULL;
+  {
+    lock l(retire_sem_);
+    for(chunk **p = &retired_; *p;) {
+      chunk *c = *p;
+      if((uintptr_t)c->header()->prev_ < e) {
+        *p = c->footer()->next_;
+        c->footer()->next_ = ready;
+        ready = c;
+        --n_retired_;
+      } else {
+        p = &c->footer()->next_;
+      }
+    }
+  }
+  while(chunk *c = ready) {
+    ready = c->footer()->next_;
+    c->header()->prev_ = NULL;
+    c->footer()->next_ = NULL;
+    deallocate(c->data(), 0);
+  }
+}
+
+void global_shared_allocator::driver::synchronize()
+{
+  uint64_t e = epoch_.fetch_add(1) + 1;
+  for(size_t i = 0; i < n_reader_; ++i) {
+    reader &r = readers_[i];
+    for(int spin = 0;; ++spin) {
+      uint64_t a = r.epoch_.load();
+      if(a == 0 || a >= e) break;
+      if(spin < 1024) continue;
+      pid_t t = r.tid_.load();
+      if(t > 0 && !alive(t)) {  // died inside
+        release(r, t);
+        continue;
+      }
+      sched_yield();
+    }
+  }
+}
+
+global_shared_allocator::driver::reader *global_shared_allocator::driver::own_reader()
+{
+  pid_t tid = shared_tid();
+  reader *cached = (reader *)epoch_local.reader;
+  if(epoch_local.driver == this && cached->tid_.load(memory_order_relaxed) == tid) return cached;
+
+  // Hashed by thread id; usually the first probe hits.
+  for(size_t i = 0; i < n_reader_; ++i) {
+    reader &r = readers_[(tid + i) % n_reader_];
+    pid_t t = r.tid_.load(memory_order_relaxed);
+    if(t == tid || (t == 0 && r.tid_.compare_exchange_strong(t, tid))) {
+      epoch_local.driver = this;
+      epoch_local.reader = &r;
+      return &r;
+    }
+  }
+
+  // Slots are not released on thread exit. Recycle those of dead threads.
+  for(size_t i = 0; i < n_reader_; ++i) {
+    reader &r = readers_[i];
+    pid_t t = r.tid_.load();
+    if(t <= 0 || alive(t)) continue;
+    if(r.tid_.compare_exchange_strong(t, tid)) {
+      r.epoch_.store(0);  // the dead owner's, before ours is announced
+      epoch_local.driver = this;
+      epoch_local.reader = &r;
+      return &r;
+    }
+  }
+  throw runtime_error("epoch_enter: out of reader slots");
+}
+
+uint64_t global_shared_allocator::driver::min_epoch()
+{
+  uint64_t e = UINT64_MAX;
+  for(size_t i = 0; i < n_reader_; ++i) {
+    reader &r = readers_[i];
+    uint64_t a = r.epoch_.load();
+    if(a == 0 || a >= e) continue;
+    pid_t t = r.tid_.load();
+    if(t > 0 && !alive(t)) {  // died inside; a new owner announces after this scan
+      release(r, t);
+      continue;
+    }
+    e = a;
+  }
+  return e;
+}
+
+void global_shared_allocator::driver::release(reader &r, pid_t dead)
+{
+  if(!r.tid_.compare_exchange_strong(dead, -1)) return;
+  r.epoch_.store(0);
+  r.tid_.store(0);
+}
+
+bool global_shared_allocator::driver::alive(pid_t tid)
+{
+  if(kill(tid, 0) && errno == ESRCH) return false;
+
+  // Zombies are still found by kill(). Their state follows the parenthesized command name.
+  char buf[512];
+  snprintf(buf, sizeof buf, "/proc/%d/stat", (int)tid);
+  int fd = open(buf, O_RDONLY | O_CLOEXEC);
+  if(fd < 0) return kill(tid, 0) == 0 || errno != ESRCH;  // gone meanwhile, or no /proc
+  ssize_t n = read(fd, buf, sizeof buf - 1);
+  close(fd);
+  if(n <= 0) return true;
+  buf[n] = 0;
+  const char *p = strrchr(buf, ')');
+  return !p || !p[1] || (p[2] != 'Z' && p[2] != 'X');
+}
+
+size_t global_shared_allocator::driver::usable_size(const void *p)
+{
+  return p ? chunk::get_chunk((void *)p)->size() : 0;
+}
+
+void *global_shared_allocator::driver::carve(size_t reqsize)
+{
+  for(size_t i = chunk::list_index(reqsize); i < n_free_list_; ++i) {
     chunk *c = free_list_[i].footer()->next_;
     while(c) {
-      if(c->size() >= size) {
-        c->allocate(size);
+      if(c->size() >= reqsize) {
+        c->allocate(reqsize);
         return c->data();
       }
       c = c->footer()->next_;
     }
   }
-  chunk *c = extend(size + sizeof(chunk));
-  c->allocate(size);
-  return c->data();
+  return NULL;
 }
 
-void global_shared_allocator::driver::deallocate(void *p, size_t)
+void global_shared_allocator::driver::consolidate()
 {
-  if(!p) return;
-  lock l;
-  chunk *c = chunk::get_chunk(p);
-  c->deallocate();
+  for(bin &b : bin_) {
+    lock l(b.sem_);
+    while(chunk *c = b.head_) {
+      b.head_ = c->footer()->next_;
+      c->footer()->next_ = NULL;
+      c->deallocate();
+    }
+  }
 }
 
 global_shared_allocator::driver::chunk *global_shared_allocator::driver::chunk::add_chunk(void *addr, size_t size)
@@ -302,7 +1112,7 @@ global_shared_allocator::driver::chunk *global_shared_allocator::driver::chunk::
 global_shared_allocator::driver::chunk *global_shared_allocator::driver::chunk::after()
 {
   chunk *c = (chunk *)&footer()[1];
-  if((uintptr_t)c + min_chunk_size_ > (uintptr_t)driver_ + driver_->size_) return NULL;
+  if((uintptr_t)c + min_chunk_size_ > (uintptr_t)driver_ + driver_->size_.load()) return NULL;
   if(c->allocated()) return NULL;
   return c;
 }
@@ -374,23 +1184,27 @@ global_shared_allocator::driver::chunk *global_shared_allocator::driver::chunk::
   return add_chunk(b, new_size);
 }
 
-global_shared_allocator::driver::chunk *global_shared_allocator::driver::extend(size_t size)
+void *global_shared_allocator::driver::extend(size_t reqsize, size_t size)
 {
-  size_t s = size_;
-  while(s < max_size_ && s - size_ < size) s *= 2;
-  if(s - size_ < size) throw bad_alloc();
-  size = s - size_;
+  size_t s = size;
+  while(s < max_size_ && s - size < reqsize + sizeof(chunk)) s *= 2;
+  if(s - size < reqsize + sizeof(chunk)) throw bad_alloc();
 
-  if(ftruncate(shmfd_, s)) throw make_system_error("ftruncate");
-  chunk *c = (chunk *)((char *)this + size_);
-  size_ = s;
-  return chunk::add_chunk(c, size);
-}
+  // Unlike ftruncate(), fallocate() never shrinks the file nor touches its content.
+  // So it is harmless to run it before the claim, even if we lose.
+  // The whole range is allocated: the mapping reserves nothing, so touching a page the file
+  // system cannot provide (e.g. a huge one) would raise SIGBUS instead of failing here.
+  if(int e = posix_fallocate(shmfd_, size, s - size)) {
+    if(e == ENOSPC || e == ENOMEM) throw bad_alloc();
+    errno = e;
+    throw make_system_error("posix_fallocate");
+  }
 
-int global_shared_allocator::driver::map_prot()
-{
-  int prot = PROT_READ;
-  if(oflag_ & O_WRONLY) prot &= ~PROT_READ;
-  if(oflag_ & O_RDWR) prot |= PROT_WRITE;
-  return prot;
+  // Claim and add under heap_sem_, so that no one holding it (e.g. checkpoint()) sees
+  // space that no chunk covers.
+  lock l(heap_sem_);
+  if(!size_.compare_exchange_strong(size, s)) return NULL;
+  chunk *c = chunk::add_chunk((char *)this + size, s - size);
+  c->allocate(reqsize);
+  return c->data();
 }
@@ -8,10 +8,25 @@
  */
 #pragma once
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <string>
 #include <new>
 
+// Kernel id of the calling thread, cached. The cache is reset in fork children.
+inline pid_t shared_tid()
+{
+  static thread_local pid_t tid;
+  static int registered = pthread_atfork(NULL, NULL, [] { tid = 0; });
+  (void)registered;
+  if(!tid) tid = syscall(SYS_gettid);
+  return tid;
+}
+
+class shared_snapshot;
+
 // The class contains all allocator states and operations.
 class global_shared_allocator {
 public:
@@ -19,15 +34,90 @@ public:
   static void *allocate(size_t n);
   static void deallocate(void *p, size_t n);
 
+  // Bytes actually reserved for an allocated block, at least the requested size.
+  static size_t usable_size(const void *p);
+
+  // Epoch-based reclamation for memory that other threads or processes may still be reading.
+  // Readers stay between epoch_enter() and epoch_leave() while they hold such pointers (see
+  // `shared_epoch_guard`); the calls nest. A block passed to retire() after being unlinked is
+  // deallocated once every thread that was inside at that time has left. Threads that die
+  // inside are detected and ignored.
+  static void epoch_enter();
+  static void epoch_leave();
+  static void retire(void *p, size_t n);
+
+  // Deallocate retired blocks that have become safe. retire() calls it periodically.
+  static void reclaim();
+
+  // Wait until every thread that is inside has left.
+  static void synchronize();
+
   // A non-NULL `name` overrides the default name generated at start.
   // Exact one process (the master) should use `oflag & O_TRUNC` to initialize shm and the driver.
   // Argument `mode` is only significant when `oflag & O_CREAT`.
   static const char *shm_open(const char *name = NULL, int oflag = O_RDWR | O_CREAT, mode_t mode = 0600);
 
+  // Like shm_open(), but back the segment with a regular file at `path`, so it outlives reboots.
+  // Without O_TRUNC an existing segment is reopened at its stored address and is usable at once.
+  // An empty file is initialized. The first process to attach resets the allocator locks and
+  // reader slots left by earlier runs; locks inside user objects are the application's concern.
+  static const char *file_open(const char *path, int oflag = O_RDWR | O_CREAT, mode_t mode = 0600);
+
+  // Write dirty pages of [p, p + n) to the file and wait, or of the whole segment if p is NULL.
+  // Data not flushed survives process restarts but not crashes of the host.
+  static void flush(const void *p = NULL, size_t n = 0);
+
+  // A pointer kept in the driver for finding the application's data after reopening.
+  static void *root();
+  static void set_root(void *p);
+
+  // Write a snapshot of the open segment to `path`, replacing it atomically when complete.
+  // Allocation and deallocation wait while the heap is copied inside the kernel; reads and
+  // writes of existing objects do not, so quiesce the writers whose data must be consistent.
+  // Run it in a separate thread to keep the caller going. A lazy restore is completed first.
+  static void checkpoint(const char *path);
+
+  // Recreate shared memory named `name` (see shm_open()) from a checkpoint and open it as the
+  // master, at the address of the checkpointed segment. Locks are reset as in file_open().
+  static const char *restore(const char *path, const char *name = NULL, mode_t mode = 0600);
+
+  // Like restore(), but return once the segment is mapped. Pages are copied in when first
+  // touched (via userfaultfd) and by a background thread, which starts with the pages touched
+  // first in the previous lazy restore (listed in `path` + ".hot") and then goes sequentially.
+  // Falls back to restore() where userfaultfd is unavailable.
+  static const char *restore_lazy(const char *path, const char *name = NULL, mode_t mode = 0600);
+
+  // Wait until a lazy restore has copied every page. Only this process's own faults are served
+  // until then, so wait before forking or letting other processes attach. Throws what stopped
+  // the copy, e.g. a read error; the segment is incomplete then, and faults on missing pages
+  // block until shm_close().
+  static void restore_wait();
+
+  // Like shm_open() with O_TRUNC, but in an anonymous memfd that can be sealed by publish().
+  // Nothing is left behind when the last process exits, and names cannot collide: they only
+  // show in /proc for debugging. `flags` are added to memfd_create(), e.g. MFD_HUGETLB, with
+  // which the segment grows in huge pages that must be reserved (see vm.nr_hugepages).
+  // Other processes attach with fd_open() from shm_fd(), e.g. passed by send_fd().
+  static const char *memfd_open(const char *name = NULL, unsigned flags = 0);
+
+  // Attach to the segment of any descriptor from shm_fd(), e.g. received by recv_fd(), without
+  // a file system lookup. The descriptor is owned from now on. With `oflag & O_TRUNC` the
+  // segment is initialized as by shm_open(). Only a sealable memfd can be published, and
+  // shm_unlink() leaves the name of any other file alone, not knowing it.
+  static void fd_open(int fd, int oflag = O_RDWR);
+
+  // Make the memfd segment immutable and close it: the heap is trimmed and sealed against
+  // writing and resizing, and stays mapped read-only by the returned snapshot, whose address
+  // range later segments therefore avoid. A non-NULL `path` is atomically made to refer to the
+  // new version (a symlink into /proc, valid while the snapshot lives) for readers to open.
+  // Destroying the snapshot removes `path` unless it refers to a later version by then.
+  // No other process may have the segment mapped writable.
+  static shared_snapshot publish(const char *path = NULL);
+
   // Close but keep the named shared memory file.
   static void shm_close();
 
-  // Remove the named shared memory file.
+  // Remove the named shared memory file (or the backing file of file_open()). No-op for memfds.
   // Using it right after the last possible shm_open() call is recommended.
   static void shm_unlink();
 
@@ -41,15 +131,63 @@ public:
   // Returns 0 if shm is not open.
   static int shm_oflag() { return oflag_; }
 
+  // The protection of the segment's mapping, derived from shm_oflag(), for mapping parts of it.
+  static int shm_prot();
+
+  // The descriptor and mapping address of the open shm, for mapping parts of it elsewhere.
+  // Offsets into the file are relative to shm_addr().
+  static int shm_fd() { return shmfd_; }
+  static void *shm_addr() { return driver_; }
+
 private:
   // These fields are local to the current process.
   static std::string name_;
   static int shmfd_;
   static int oflag_;
+  static enum backing { shm_backed, file_backed, memfd_backed, fd_backed } backing_;
 
   // The driver lies at the very beginning of the shared memory.
   class driver;
   static class driver *driver_;
+
+  friend class shared_snapshot;
+};
+
+// A published segment (see global_shared_allocator::publish()) mapped read-only at its own
+// address, independently of the segment open in global_shared_allocator. The data is immutable,
+// so containers inside are read without any synchronization. Nothing may be allocated or freed.
+class shared_snapshot {
+public:
+  // Takes over a sealed memfd, e.g. received with recv_fd().
+  explicit shared_snapshot(int fd);
+
+  // Opens the current version at a path given to publish().
+  explicit shared_snapshot(const char *path);
+
+  shared_snapshot(shared_snapshot &&s) : fd_(s.fd_), addr_(s.addr_), size_(s.size_), link_(std::move(s.link_))
+  {
+    s.fd_ = -1;
+    s.addr_ = NULL;
+    s.link_.clear();
+  }
+  shared_snapshot &operator=(shared_snapshot &&s);
+  ~shared_snapshot();
+
+  // The root set with global_shared_allocator::set_root() before publishing.
+  void *root() const;
+  const void *addr() const { return addr_; }
+  size_t size() const { return size_; }
+
+  // For passing the snapshot to other processes with send_fd().
+  int fd() const { return fd_; }
+
+private:
+  int fd_;
+  void *addr_;
+  size_t size_;
+  std::string link_;  // published by us to refer to fd_
+
+  friend class global_shared_allocator;
 };
 
 // A complete stateless type-specific allocator template.
@@ -73,6 +211,16 @@ public:
 
 // Supports fast move-construction and move-assignment for T.
 template<class T> inline bool operator==(const shared_allocator<T> &, const shared_allocator<T> &) { return true; }
+template<class T> inline bool operator!=(const shared_allocator<T> &, const shared_allocator<T> &) { return false; }
+
+// Keeps retired memory alive while in scope.
+class shared_epoch_guard {
+public:
+  shared_epoch_guard() { global_shared_allocator::epoch_enter(); }
+  ~shared_epoch_guard() { global_shared_allocator::epoch_leave(); }
+  shared_epoch_guard(const shared_epoch_guard &) = delete;
+  shared_epoch_guard &operator=(const shared_epoch_guard &) = delete;
+};
 
 // Placement new/delete operators for shared memory.
 inline constexpr struct shared_t { } shared;
@@ -0,0 +1,160 @@
+/*
+ * Append-only log shared by processes.
+ *
+ * Elements live in fixed-size segments that are never moved nor freed while
+ * the log exists, so references stay valid and growth costs one segment
+ * allocation instead of a copy. Writers reserve positions with an atomic
+ * counter and publish them in order; readers see the committed prefix
+ * without any lock:
+ *   auto *log = new(shared) shared_append_log<event>;
+ *   log->push_back(e);                                  // writers
+ *   for(size_t i = 0; i < log->size(); ++i) f((*log)[i]);  // readers
+ *
+ * Positions are published in order, so a writer that dies between reserving
+ * and publishing its position stalls every later writer and waiting reader
+ * for good. Do not kill writers inside push_back(); such a log cannot be
+ * recovered and must be rebuilt.
+ *
+ * Written by <lyazj@github.com>.
+ */
+#pragma once
+#include "shared_sync.h"
+#include <utility>
+#include <iterator>
+#include <exception>
+#include <stdexcept>
+#include <stddef.h>
+
+template<class T>
+class shared_append_log {
+public:
+  typedef T value_type;
+
+  // The segment size is rounded up to a power of 2, and so is the number of segments needed
+  // for the capacity. The directory takes a pointer per segment up front.
+  explicit shared_append_log(size_t segment_size = 1024, size_t capacity = (size_t)1 << 20);
+  ~shared_append_log();
+  shared_append_log(const shared_append_log &) = delete;
+  shared_append_log &operator=(const shared_append_log &) = delete;
+
+  // Returns the position. It becomes visible once all earlier positions are.
+  template<class... Args> size_t emplace_back(Args &&...args);
+  size_t push_back(const T &v) { return emplace_back(v); }
+  size_t push_back(T &&v) { return emplace_back(std::move(v)); }
+
+  // The committed length. Elements below it are immutable.
+  size_t size() const { return committed_.load(std::memory_order_acquire); }
+  bool empty() const { return size() == 0; }
+  size_t capacity() const { return (mask_ + 1) << dir_shift_; }
+  const T &operator[](size_t i) const { return dir_[i >> seg_shift_].load(std::memory_order_relaxed)[i & mask_]; }
+
+  // Block until size() > n, e.g. to follow the log.
+  void wait(size_t n) { appended_.wait([this, n] { return size() > n; }); }
+
+  // Iterates over the committed prefix at the time end() is called.
+  class const_iterator {
+  public:
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef T value_type;
+    typedef ptrdiff_t difference_type;
+    typedef const T *pointer;
+    typedef const T &reference;
+
+    const_iterator() : log_(NULL), i_(0) { }
+    const_iterator(const shared_append_log *log, size_t i) : log_(log), i_(i) { }
+    reference operator*() const { return (*log_)[i_]; }
+    pointer operator->() const { return &**this; }
+    reference operator[](ptrdiff_t n) const { return (*log_)[i_ + n]; }
+    const_iterator &operator++() { ++i_; return *this; }
+    const_iterator &operator--() { --i_; return *this; }
+    const_iterator operator++(int) { return const_iterator(log_, i_++); }
+    const_iterator operator--(int) { return const_iterator(log_, i_--); }
+    const_iterator &operator+=(ptrdiff_t n) { i_ += n; return *this; }
+    const_iterator &operator-=(ptrdiff_t n) { i_ -= n; return *this; }
+    friend const_iterator operator+(const_iterator it, ptrdiff_t n) { return it += n; }
+    friend const_iterator operator-(const_iterator it, ptrdiff_t n) { return it -= n; }
+    friend ptrdiff_t operator-(const const_iterator &a, const const_iterator &b) { return a.i_ - b.i_; }
+    friend bool operator==(const const_iterator &a, const const_iterator &b) { return a.i_ == b.i_; }
+    friend bool operator!=(const const_iterator &a, const const_iterator &b) { return a.i_ != b.i_; }
+    friend bool operator<(const const_iterator &a, const const_iterator &b) { return a.i_ < b.i_; }
+
+  private:
+    const shared_append_log *log_;
+    size_t i_;
+  };
+  typedef const_iterator iterator;
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, size()); }
+
+private:
+  size_t seg_shift_, dir_shift_, mask_;
+  std::atomic<T *> *dir_;  // segments are installed by CAS
+  std::atomic<size_t> reserved_;
+  std::atomic<size_t> committed_;
+  shared_event_count appended_;  // for readers and for writers waiting for their turn
+
+  static size_t log2_ceil(size_t n) { size_t s = 0; while(((size_t)1 << s) < n) ++s; return s; }
+  T *segment(size_t s);
+};
+
+template<class T>
+shared_append_log<T>::shared_append_log(size_t segment_size, size_t capacity)
+  : seg_shift_(log2_ceil(segment_size)), dir_shift_(log2_ceil((capacity + ((size_t)1 << seg_shift_) - 1) >> seg_shift_)),
+    mask_(((size_t)1 << seg_shift_) - 1), reserved_(0), committed_(0)
+{
+  size_t n = (size_t)1 << dir_shift_;
+  dir_ = shared_allocator<std::atomic<T *>>().allocate(n);
+  for(size_t i = 0; i < n; ++i) new(&dir_[i]) std::atomic<T *>(NULL);
+}
+
+template<class T>
+shared_append_log<T>::~shared_append_log()
+{
+  size_t n = committed_.load();
+  for(size_t i = 0; i < n; ++i) (*this)[i].~T();
+  for(size_t s = 0; s < (size_t)1 << dir_shift_; ++s) {
+    if(T *p = dir_[s].load()) shared_allocator<T>().deallocate(p, mask_ + 1);
+  }
+  shared_allocator<std::atomic<T *>>().deallocate(dir_, (size_t)1 << dir_shift_);
+}
+
+template<class T>
+template<class... Args>
+size_t shared_append_log<T>::emplace_back(Args &&...args)
+{
+  // The segment is found (or allocated, which may throw) before the position is reserved:
+  // an unpublished position would stall every later writer.
+  size_t i = reserved_.load();
+  T *seg;
+  do {
+    if(i >= capacity()) throw std::length_error("shared_append_log: full");
+    seg = segment(i >> seg_shift_);
+  } while(!reserved_.compare_exchange_weak(i, i + 1));
+  T *p = &seg[i & mask_];
+
+  // A throwing constructor would stall every later writer, so give up.
+  try {
+    new(p) T(std::forward<Args>(args)...);
+  } catch(...) {
+    std::terminate();
+  }
+
+  // Publish in order: wait (sleeping if it takes long) for the writers of earlier positions.
+  appended_.wait([this, i] { return committed_.load(std::memory_order_acquire) == i; });
+  committed_.store(i + 1, std::memory_order_release);
+  appended_.notify();
+  return i;
+}
+
+template<class T>
+T *shared_append_log<T>::segment(size_t s)
+{
+  T *p = dir_[s].load(std::memory_order_acquire);
+  if(p) return p;
+
+  // Racing writers allocate; one wins, the others give theirs back.
+  T *fresh = shared_allocator<T>().allocate(mask_ + 1);
+  if(dir_[s].compare_exchange_strong(p, fresh)) return fresh;
+  shared_allocator<T>().deallocate(fresh, mask_ + 1);
+  return p;
+}
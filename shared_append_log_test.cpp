@@ -0,0 +1,87 @@
+#include "shared_append_log.h"
+#include <vector>
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <iostream>
+
+using namespace std;
+
+struct event {
+  int writer;
+  long seq;
+};
+
+static constexpr int n_writer = 4, n_reader = 2;
+static constexpr long n_event = 10000;
+static shared_append_log<event> *log_;
+
+int main()
+{
+  global_shared_allocator::shm_open(NULL, O_RDWR | O_CREAT | O_TRUNC);
+  atexit(global_shared_allocator::shm_close);
+  global_shared_allocator::shm_unlink();
+
+  // Small segments to cross many boundaries.
+  log_ = new(shared) shared_append_log<event>(100, 128 * 4000);
+  assert(log_->capacity() == 128 * 4096 && log_->empty());
+  for(int w = 0; w < n_writer; ++w) {
+    pid_t pid = fork();
+    if(pid < 0) err(EXIT_FAILURE, "fork");
+    if(pid) continue;
+    for(long i = 0; i < n_event; ++i) log_->push_back({w, i});
+    _exit(0);
+  }
+
+  // Readers follow the log: each writer's events appear in order, never torn.
+  for(int r = 0; r < n_reader; ++r) {
+    pid_t pid = fork();
+    if(pid < 0) err(EXIT_FAILURE, "fork");
+    if(pid) continue;
+    vector<long> next(n_writer);
+    log_->wait(0);
+    const event *first = &(*log_)[0];
+    for(size_t i = 0; i < n_writer * n_event; ++i) {
+      log_->wait(i);
+      const event &e = (*log_)[i];
+      assert(e.writer >= 0 && e.writer < n_writer && e.seq == next[e.writer]++);
+    }
+    assert(&(*log_)[0] == first);  // never moved
+    _exit(0);
+  }
+  int status;
+  while(wait(&status) > 0) assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  assert(log_->size() == n_writer * n_event);
+  long sum = 0;
+  for(const event &e : *log_) sum += e.seq;
+  assert(sum == n_writer * (n_event * (n_event - 1) / 2));
+  log_->~shared_append_log();
+  operator delete(log_, shared);
+
+  // A segment that cannot be allocated fails the append without reserving a position.
+  auto *huge = new(shared) shared_append_log<long>((size_t)1 << 30, (size_t)1 << 31);
+  for(int i = 0; i < 2; ++i) {
+    try {
+      huge->push_back(i);
+      assert(false);
+    } catch(const bad_alloc &) { }
+  }
+  assert(huge->empty());
+  huge->~shared_append_log();
+  operator delete(huge, shared);
+
+  // A full log refuses more.
+  auto *small = new(shared) shared_append_log<long>(1, 2);
+  assert(small->push_back(1) == 0 && small->push_back(2) == 1);
+  try {
+    small->push_back(3);
+    assert(false);
+  } catch(const length_error &) { }
+  assert(small->size() == 2 && (*small)[1] == 2);
+  small->~shared_append_log();
+  operator delete(small, shared);
+  cout << "passed" << endl;
+  return 0;
+}
@@ -0,0 +1,495 @@
+/*
+ * B+ tree containers with wide nodes in the shared heap.
+ *
+ * Elements live in leaves of about NodeBytes bytes, linked both ways for
+ * ordered iteration. A separator in an inner node is the first key of its
+ * right subtree. Erasing does not rebalance: leaves may become sparse, and
+ * are freed once empty. Iterators are invalidated by insertion, and those to
+ * the erased element's leaf by erasure.
+ * Like std containers, they need external locking across processes.
+ *
+ * Written by <lyazj@github.com>.
+ */
+#pragma once
+#include "shared_container.h"
+#include <algorithm>
+#include <utility>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <stdint.h>
+#include <stddef.h>
+
+// The common implementation. KeyOf extracts the key from a value.
+template<class K, class T, class KeyOf, class C, size_t NodeBytes>
+class shared_btree {
+protected:
+  struct node;
+  struct leaf;
+  struct inner;
+
+public:
+  typedef K key_type;
+  typedef T value_type;
+  typedef C key_compare;
+  typedef size_t size_type;
+
+  template<bool Const> class basic_iterator {
+  public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef T value_type;
+    typedef ptrdiff_t difference_type;
+    typedef std::conditional_t<Const, const T, T> *pointer;
+    typedef std::conditional_t<Const, const T, T> &reference;
+
+    basic_iterator() : tree_(NULL), leaf_(NULL), i_(0) { }
+    template<bool B, class = std::enable_if_t<Const && !B>>
+    basic_iterator(const basic_iterator<B> &it) : tree_(it.tree_), leaf_(it.leaf_), i_(it.i_) { }
+
+    reference operator*() const { return *leaf_->slot(i_); }
+    pointer operator->() const { return leaf_->slot(i_); }
+    basic_iterator &operator++()
+    {
+      if(++i_ == leaf_->n_) *this = basic_iterator(tree_, leaf_->next_, 0);
+      return *this;
+    }
+    basic_iterator &operator--()
+    {
+      if(i_) { --i_; return *this; }
+      leaf *l = leaf_ ? leaf_->prev_ : tree_->last_;
+      while(l->n_ == 0) l = l->prev_;  // never out of range for a valid iterator
+      leaf_ = l;
+      i_ = l->n_ - 1;
+      return *this;
+    }
+    basic_iterator operator++(int) { basic_iterator it = *this; ++*this; return it; }
+    basic_iterator operator--(int) { basic_iterator it = *this; --*this; return it; }
+    friend bool operator==(const basic_iterator &a, const basic_iterator &b) { return a.leaf_ == b.leaf_ && a.i_ == b.i_; }
+    friend bool operator!=(const basic_iterator &a, const basic_iterator &b) { return !(a == b); }
+
+  private:
+    friend class shared_btree;
+    template<bool> friend class basic_iterator;
+    const shared_btree *tree_;
+    leaf *leaf_;  // NULL for end()
+    uint32_t i_;
+
+    // Skips empty leaves forward.
+    basic_iterator(const shared_btree *tree, leaf *l, uint32_t i) : tree_(tree), leaf_(l), i_(i)
+    {
+      while(leaf_ && i_ == leaf_->n_) {
+        leaf_ = leaf_->next_;
+        i_ = 0;
+      }
+    }
+  };
+  typedef basic_iterator<false> iterator;
+  typedef basic_iterator<true> const_iterator;
+
+  shared_btree() : root_(NULL), first_(NULL), last_(NULL), size_(0), height_(0) { }
+  template<class It> shared_btree(It first, It last) : shared_btree() { insert(first, last); }
+  shared_btree(std::initializer_list<T> l) : shared_btree(l.begin(), l.end()) { }
+  shared_btree(const shared_btree &o) : shared_btree() { assign_sorted(o.begin(), o.end()); }
+  shared_btree(shared_btree &&o) noexcept : shared_btree() { swap(o); }
+  shared_btree &operator=(shared_btree o) { swap(o); return *this; }
+  ~shared_btree() { clear(); }
+
+  void swap(shared_btree &o) noexcept
+  {
+    std::swap(root_, o.root_);
+    std::swap(first_, o.first_);
+    std::swap(last_, o.last_);
+    std::swap(size_, o.size_);
+    std::swap(height_, o.height_);
+  }
+
+  iterator begin() { return iterator(this, first_, 0); }
+  iterator end() { return iterator(this, NULL, 0); }
+  const_iterator begin() const { return const_iterator(this, first_, 0); }
+  const_iterator end() const { return const_iterator(this, NULL, 0); }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  iterator lower_bound(const K &k) { return bound(k, false); }
+  iterator upper_bound(const K &k) { return bound(k, true); }
+  const_iterator lower_bound(const K &k) const { return ((shared_btree *)this)->bound(k, false); }
+  const_iterator upper_bound(const K &k) const { return ((shared_btree *)this)->bound(k, true); }
+  std::pair<iterator, iterator> equal_range(const K &k) { return {lower_bound(k), upper_bound(k)}; }
+  std::pair<const_iterator, const_iterator> equal_range(const K &k) const { return {lower_bound(k), upper_bound(k)}; }
+  iterator find(const K &k)
+  {
+    iterator it = lower_bound(k);
+    return it == end() || C()(k, KeyOf()(*it)) ? end() : it;
+  }
+  const_iterator find(const K &k) const { return ((shared_btree *)this)->find(k); }
+  bool contains(const K &k) const { return find(k) != end(); }
+  size_t count(const K &k) const { return contains(k); }
+
+  std::pair<iterator, bool> insert(const T &v) { return insert_unique(v); }
+  std::pair<iterator, bool> insert(T &&v) { return insert_unique(std::move(v)); }
+  template<class It> void insert(It first, It last) { for(; first != last; ++first) insert(*first); }
+  template<class... Args> std::pair<iterator, bool> emplace(Args &&...args) { return insert_unique(T(std::forward<Args>(args)...)); }
+
+  // Replace the content by sorted input, keeping the first of equal keys.
+  // Leaves are filled completely, so this is much faster and denser than insert().
+  template<class It> void assign_sorted(It first, It last);
+
+  size_t erase(const K &k)
+  {
+    iterator it = find(k);
+    if(it == end()) return 0;
+    erase(it);
+    return 1;
+  }
+  iterator erase(const_iterator it)
+  {
+    leaf *l = it.leaf_;
+    --size_;
+    if(l->n_ > 1) {
+      erase_at(l->slot(0), l->n_, it.i_);
+      return iterator(this, l, it.i_);
+    }
+    leaf *next = l->next_;
+    remove_leaf(l);
+    return iterator(this, next, 0);
+  }
+
+  void clear()
+  {
+    if(root_) free_node(root_, height_);
+    root_ = NULL;
+    first_ = last_ = NULL;
+    size_ = 0;
+    height_ = 0;
+  }
+
+protected:
+  // Node capacities derived from NodeBytes and the padded layouts below.
+  static constexpr size_t round_up(size_t n, size_t a) { return (n + a - 1) / a * a; }
+  static inline constexpr size_t node_header_ = round_up(sizeof(uint32_t), alignof(void *));
+  static inline constexpr size_t leaf_align_ = std::max(alignof(T), alignof(void *));
+  static inline constexpr size_t leaf_data_ = round_up(node_header_ + 2 * sizeof(void *), alignof(T));
+  static inline constexpr size_t leaf_room_ = NodeBytes / leaf_align_ * leaf_align_;
+  static inline constexpr size_t leaf_cap_ = leaf_room_ >= leaf_data_ + 4 * sizeof(T) ? (leaf_room_ - leaf_data_) / sizeof(T) : 4;
+  static inline constexpr size_t inner_align_ = std::max(alignof(K), alignof(void *));
+  static inline constexpr size_t inner_fixed_ = node_header_ + sizeof(void *) + (inner_align_ - alignof(void *));
+  static inline constexpr size_t inner_room_ = NodeBytes / inner_align_ * inner_align_;
+  static inline constexpr size_t inner_cap_ = inner_room_ >= inner_fixed_ + 3 * (sizeof(K) + sizeof(void *)) ? (inner_room_ - inner_fixed_) / (sizeof(K) + sizeof(void *)) : 3;
+
+  struct node {
+    uint32_t n_;  // #elements in a leaf, #keys in an inner node
+  };
+
+  struct leaf : node {
+    leaf *prev_, *next_;
+    alignas(T) unsigned char data_[leaf_cap_ * sizeof(T)];
+    T *slot(size_t i) { return (T *)data_ + i; }
+  };
+
+  struct inner : node {
+    node *child_[inner_cap_ + 1];
+    alignas(K) unsigned char keys_[inner_cap_ * sizeof(K)];
+    K *key(size_t i) { return (K *)keys_ + i; }
+  };
+
+  static_assert(sizeof(leaf) <= NodeBytes || leaf_cap_ == 4);
+  static_assert(sizeof(inner) <= NodeBytes || inner_cap_ == 3);
+
+  node *root_;
+  leaf *first_, *last_;
+  size_t size_;
+  size_t height_;  // #inner levels
+
+  static leaf *new_leaf()
+  {
+    leaf *l = shared_allocator<leaf>().allocate(1);
+    l->n_ = 0;
+    l->prev_ = l->next_ = NULL;
+    return l;
+  }
+
+  static inner *new_inner()
+  {
+    inner *in = shared_allocator<inner>().allocate(1);
+    in->n_ = 0;
+    return in;
+  }
+
+  static void free_node(node *n, size_t height)
+  {
+    if(height == 0) {
+      leaf *l = (leaf *)n;
+      for(size_t i = 0; i < l->n_; ++i) l->slot(i)->~T();
+      shared_allocator<leaf>().deallocate(l, 1);
+    } else {
+      inner *in = (inner *)n;
+      for(size_t i = 0; i <= in->n_; ++i) free_node(in->child_[i], height - 1);
+      for(size_t i = 0; i < in->n_; ++i) in->key(i)->~K();
+      shared_allocator<inner>().deallocate(in, 1);
+    }
+  }
+
+  // Array helpers on raw storage holding n constructed objects.
+  template<class U, class V> static void insert_at(U *a, size_t n, size_t i, V &&v)
+  {
+    if(i == n) { new(&a[n]) U(std::forward<V>(v)); return; }
+    new(&a[n]) U(std::move(a[n - 1]));
+    for(size_t j = n - 1; j > i; --j) a[j] = std::move(a[j - 1]);
+    a[i] = std::forward<V>(v);
+  }
+  template<class U> static void erase_at(U *a, uint32_t &n, size_t i)
+  {
+    for(size_t j = i + 1; j < n; ++j) a[j - 1] = std::move(a[j]);
+    a[--n].~U();
+  }
+  template<class U> static void move_out(U *from, U *to, size_t n)
+  {
+    for(size_t i = 0; i < n; ++i) {
+      new(&to[i]) U(std::move(from[i]));
+      from[i].~U();
+    }
+  }
+
+  // The index of the child whose subtree may contain k.
+  static size_t route(inner *in, const K &k)
+  {
+    size_t lo = 0, hi = in->n_;
+    while(lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if(C()(k, *in->key(mid))) hi = mid; else lo = mid + 1;
+    }
+    return lo;
+  }
+
+  // The first element not less than (or greater than, if upper) k in a leaf.
+  static size_t search(leaf *l, const K &k, bool upper)
+  {
+    size_t lo = 0, hi = l->n_;
+    while(lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      bool right = upper ? !C()(k, KeyOf()(*l->slot(mid))) : C()(KeyOf()(*l->slot(mid)), k);
+      if(right) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+  }
+
+  iterator bound(const K &k, bool upper)
+  {
+    if(!root_) return end();
+    node *n = root_;
+    for(size_t h = height_; h; --h) n = ((inner *)n)->child_[route((inner *)n, k)];
+    return iterator(this, (leaf *)n, search((leaf *)n, k, upper));
+  }
+
+  template<class V> std::pair<iterator, bool> insert_unique(V &&v);
+  void remove_leaf(leaf *l);  // holding its last element
+};
+
+template<class K, class T, class KeyOf, class C, size_t NodeBytes>
+template<class V>
+std::pair<typename shared_btree<K, T, KeyOf, C, NodeBytes>::iterator, bool>
+shared_btree<K, T, KeyOf, C, NodeBytes>::insert_unique(V &&v)
+{
+  if(!root_) root_ = first_ = last_ = new_leaf();
+
+  // Descend, remembering the path for splits.
+  const K &k = KeyOf()(v);
+  inner *path[64];
+  size_t index[64];
+  node *n = root_;
+  for(size_t h = 0; h < height_; ++h) {
+    path[h] = (inner *)n;
+    index[h] = route(path[h], k);
+    n = path[h]->child_[index[h]];
+  }
+  leaf *l = (leaf *)n;
+  size_t i = search(l, k, false);
+  if(i < l->n_ && !C()(k, KeyOf()(*l->slot(i)))) return {iterator(this, l, i), false};
+  ++size_;
+  if(l->n_ < leaf_cap_) {
+    insert_at(l->slot(0), l->n_++, i, std::forward<V>(v));
+    return {iterator(this, l, i), true};
+  }
+
+  // Split the leaf in halves and insert into one of them.
+  leaf *r = new_leaf();
+  size_t half = leaf_cap_ / 2;
+  move_out(l->slot(half), r->slot(0), leaf_cap_ - half);
+  r->n_ = leaf_cap_ - half;
+  l->n_ = half;
+  r->prev_ = l;
+  r->next_ = l->next_;
+  (l->next_ ? l->next_->prev_ : last_) = r;
+  l->next_ = r;
+  leaf *target = i <= half ? l : r;
+  size_t ti = i <= half ? i : i - half;
+  insert_at(target->slot(0), target->n_++, ti, std::forward<V>(v));
+  iterator result(this, target, ti);
+
+  // Propagate the separator upwards, splitting full inner nodes.
+  K sep = KeyOf()(*r->slot(0));
+  node *child = r;
+  for(size_t h = height_; h--;) {
+    inner *p = path[h];
+    size_t j = index[h];
+    if(p->n_ < inner_cap_) {
+      insert_at(p->child_, p->n_ + 1, j + 1, child);
+      insert_at(p->key(0), p->n_++, j, std::move(sep));
+      return {result, true};
+    }
+    inner *q = new_inner();
+    size_t mid = inner_cap_ / 2;
+    K up(std::move(*p->key(mid)));
+    p->key(mid)->~K();
+    move_out(p->key(mid + 1), q->key(0), inner_cap_ - mid - 1);
+    for(size_t c = mid + 1; c <= inner_cap_; ++c) q->child_[c - mid - 1] = p->child_[c];
+    q->n_ = inner_cap_ - mid - 1;
+    p->n_ = mid;
+    inner *t = j <= mid ? p : q;
+    size_t tj = j <= mid ? j : j - mid - 1;
+    insert_at(t->child_, t->n_ + 1, tj + 1, child);
+    insert_at(t->key(0), t->n_++, tj, std::move(sep));
+    sep = std::move(up);
+    child = q;
+  }
+
+  // The root was split.
+  inner *root = new_inner();
+  root->child_[0] = root_;
+  root->child_[1] = child;
+  new(root->key(0)) K(std::move(sep));
+  root->n_ = 1;
+  root_ = root;
+  ++height_;
+  return {result, true};
+}
+
+template<class K, class T, class KeyOf, class C, size_t NodeBytes>
+void shared_btree<K, T, KeyOf, C, NodeBytes>::remove_leaf(leaf *l)
+{
+  // Find the path by the last key; it leads to l.
+  const K &k = KeyOf()(*l->slot(0));
+  inner *path[64];
+  size_t index[64];
+  node *n = root_;
+  for(size_t h = 0; h < height_; ++h) {
+    path[h] = (inner *)n;
+    index[h] = route(path[h], k);
+    n = path[h]->child_[index[h]];
+  }
+  (l->prev_ ? l->prev_->next_ : first_) = l->next_;
+  (l->next_ ? l->next_->prev_ : last_) = l->prev_;
+  free_node(l, 0);
+
+  // Drop the child with the separator on its left (or right, for the first child).
+  // Separators left behind still bound the neighbouring subtrees correctly.
+  // Inner nodes losing their only child go too.
+  bool removed = false;
+  for(size_t h = height_; h-- && !removed;) {
+    inner *p = path[h];
+    size_t j = index[h];
+    if(p->n_ == 0) {
+      shared_allocator<inner>().deallocate(p, 1);
+      continue;
+    }
+    for(size_t c = j; c < p->n_; ++c) p->child_[c] = p->child_[c + 1];
+    erase_at(p->key(0), p->n_, j ? j - 1 : 0);
+    removed = true;
+  }
+  if(!removed) {  // the tree is empty
+    root_ = NULL;
+    height_ = 0;
+    return;
+  }
+
+  // Shorten the tree while the root has a single child.
+  while(height_ && root_->n_ == 0) {
+    inner *r = (inner *)root_;
+    root_ = r->child_[0];
+    shared_allocator<inner>().deallocate(r, 1);
+    --height_;
+  }
+}
+
+template<class K, class T, class KeyOf, class C, size_t NodeBytes>
+template<class It>
+void shared_btree<K, T, KeyOf, C, NodeBytes>::assign_sorted(It first, It last)
+{
+  clear();
+  if(first == last) return;
+
+  // Fill leaves.
+  std::vector<std::pair<node *, K>> level;
+  leaf *l = NULL;
+  for(; first != last; ++first) {
+    if(l && l->n_ && !C()(KeyOf()(*l->slot(l->n_ - 1)), KeyOf()(*first))) continue;  // duplicate
+    if(!l || l->n_ == leaf_cap_) {
+      leaf *r = new_leaf();
+      r->prev_ = l;
+      (l ? l->next_ : first_) = r;
+      l = r;
+      level.emplace_back(l, KeyOf()(*first));
+    }
+    new(l->slot(l->n_++)) T(*first);
+    ++size_;
+  }
+  last_ = l;
+
+  // Build inner levels bottom-up.
+  while(level.size() > 1) {
+    std::vector<std::pair<node *, K>> upper;
+    for(size_t i = 0; i < level.size();) {
+      inner *in = new_inner();
+      upper.emplace_back(in, level[i].second);
+      in->child_[0] = level[i++].first;
+      for(; in->n_ < inner_cap_ && i < level.size(); ++i) {
+        new(in->key(in->n_)) K(std::move(level[i].second));
+        in->child_[++in->n_] = level[i].first;
+      }
+    }
+    level.swap(upper);
+    ++height_;
+  }
+  root_ = level[0].first;
+}
+
+template<class K, class C = std::less<K>, size_t NodeBytes = 256>
+class shared_btree_set : public shared_btree<K, K, shared_identity_key, C, NodeBytes> {
+  typedef shared_btree<K, K, shared_identity_key, C, NodeBytes> base;
+public:
+  using base::base;
+};
+
+// Keys must not be modified through iterators.
+template<class K, class V, class C = std::less<K>, size_t NodeBytes = 256>
+class shared_btree_map : public shared_btree<K, std::pair<K, V>, shared_first_key, C, NodeBytes> {
+  typedef shared_btree<K, std::pair<K, V>, shared_first_key, C, NodeBytes> base;
+public:
+  typedef V mapped_type;
+  using base::base;
+
+  template<class... Args> std::pair<typename base::iterator, bool> try_emplace(const K &k, Args &&...args)
+  {
+    auto it = base::lower_bound(k);
+    if(it != base::end() && !C()(k, it->first)) return {it, false};
+    return base::insert(std::pair<K, V>(std::piecewise_construct, std::forward_as_tuple(k), std::forward_as_tuple(std::forward<Args>(args)...)));
+  }
+  template<class M> std::pair<typename base::iterator, bool> insert_or_assign(const K &k, M &&m)
+  {
+    auto r = try_emplace(k, std::forward<M>(m));
+    if(!r.second) r.first->second = std::forward<M>(m);
+    return r;
+  }
+
+  V &operator[](const K &k) { return try_emplace(k).first->second; }
+  V &at(const K &k)
+  {
+    auto it = base::find(k);
+    if(it == base::end()) throw std::out_of_range("shared_btree_map::at");
+    return it->second;
+  }
+  const V &at(const K &k) const { return ((shared_btree_map *)this)->at(k); }
+};
@@ -0,0 +1,103 @@
+#include "shared_btree_map.h"
+#include <map>
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <iostream>
+
+using namespace std;
+
+int main()
+{
+  srand(time(NULL));
+  global_shared_allocator::shm_open(NULL, O_RDWR | O_CREAT | O_TRUNC);
+  atexit(global_shared_allocator::shm_close);
+  global_shared_allocator::shm_unlink();
+
+  // Reference.
+  map<int, int> v;
+
+  // Perform the same operations randomly to v and m. Small nodes make the tree deep.
+  shared_btree_map<int, shared_string, less<int>, 128> &m = *new(shared) shared_btree_map<int, shared_string, less<int>, 128>;
+  for(int i = 0; i < 100000; ++i) {
+    int k = rand() % 20000;
+    if(rand() % 4) {
+      bool inserted = v.emplace(k, i).second;
+      assert(m.try_emplace(k, to_string(i).c_str()).second == inserted);
+    } else {
+      assert(m.erase(k) == v.erase(k));
+    }
+  }
+  assert(m.size() == v.size());
+  auto it = m.begin();
+  for(auto &[k, i] : v) {
+    assert(it->first == k && it->second == to_string(i).c_str());
+    ++it;
+  }
+  assert(it == m.end());
+  for(auto rit = v.rbegin(); rit != v.rend(); ++rit) assert((--it)->first == rit->first);
+  for(int i = 0; i < 1000; ++i) {
+    int k = rand() % 21000;
+    auto a = v.lower_bound(k);
+    auto b = m.lower_bound(k);
+    assert(a == v.end() ? b == m.end() : b->first == a->first);
+    a = v.upper_bound(k);
+    b = m.upper_bound(k);
+    assert(a == v.end() ? b == m.end() : b->first == a->first);
+  }
+
+  // Emptied leaves and subtrees are removed: erase a wide range, then everything.
+  shared_btree_map<int, int, less<int>, 128> &e = *new(shared) shared_btree_map<int, int, less<int>, 128>;
+  for(int i = 0; i < 20000; ++i) e.emplace(i, i);
+  for(auto it = e.lower_bound(1000); it != e.end() && it->first < 19000;) it = e.erase(it);
+  assert(e.size() == 2000 && e.lower_bound(1000)->first == 19000 && (--e.lower_bound(1000))->first == 999);
+  for(int i = 1000; i < 19000; i += 7) assert(e.emplace(i, i).second);
+  for(int i = 0; i < 20000; i += 3) e.erase(i);
+  for(int i = 1; i < 20000; i += 3) e.erase(i);
+  for(auto it = e.begin(); it != e.end();) it = e.erase(it);
+  assert(e.empty() && e.begin() == e.end());
+  for(int i = 0; i < 1000; ++i) assert(e.emplace(i, i).second && e.at(i) == i);
+  e.clear();
+
+  // Bulk loading from sorted input with duplicates.
+  shared_vector<long> sorted;
+  for(long i = 0; i < 100000; ++i) sorted.push_back(i / 2 * 3);
+  shared_btree_set<long> &s = *new(shared) shared_btree_set<long>;
+  s.assign_sorted(sorted.begin(), sorted.end());
+  assert(s.size() == 50000 && s.contains(3) && !s.contains(4));
+
+  pid_t pid = fork();
+  if(pid < 0) {
+    err(EXIT_FAILURE, "fork");
+  } else if(pid == 0) {  // child
+    // Range scan and modify in another process.
+    long n = 0;
+    for(auto it = s.lower_bound(300); it != s.end() && *it < 600; ++it) ++n;
+    assert(n == 100);
+    for(long i = 1; i < 150000; i += 3) assert(s.insert(i).second);
+    for(auto it = m.begin(); it != m.end();) {
+      if(it->first % 2) it = m.erase(it); else ++it;
+    }
+    _exit(0);
+  }
+  int status;
+  wait(&status);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  assert(s.size() == 100000);
+  long prev = -1;
+  for(long x : s) {
+    assert(x > prev && x % 3 != 2);
+    prev = x;
+  }
+  for(auto &[k, i] : v) assert(m.contains(k) == !(k % 2));
+  shared_btree_map<int, shared_string, less<int>, 128> copy(m);
+  assert(copy.size() == m.size() && copy.begin()->second == m.begin()->second);
+  m.clear();
+  assert(m.empty() && m.begin() == m.end());
+  cout << "passed" << endl;
+  return 0;
+}
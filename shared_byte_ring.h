@@ -0,0 +1,146 @@
+/*
+ * Zero-copy single-producer single-consumer byte stream.
+ *
+ * The ring lives in the shared memory. Each process accesses it through a
+ * local `view`, which maps the ring pages twice back to back so that any
+ * reserved or readable range is contiguous, wrapped or not:
+ *   auto *r = new(shared) shared_byte_ring(1 << 20);
+ *   shared_byte_ring::view v(*r);
+ *   char *p = v.reserve(n); fill(p, n); v.commit(n);              // producer
+ *   size_t n; const char *p = v.peek(n); use(p, n); v.release(n);  // consumer
+ *
+ * Written by <lyazj@github.com>.
+ */
+#pragma once
+#include "shared_sync.h"
+#include <system_error>
+#include <stdexcept>
+#include <algorithm>
+#include <stddef.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+class shared_byte_ring {
+public:
+  // Capacity is rounded up to a multiple of the segment's page size (the huge page size on
+  // hugetlbfs), which views must map in whole.
+  explicit shared_byte_ring(size_t capacity)
+  {
+    if(capacity == 0) throw std::invalid_argument("zero ring capacity");
+    struct stat st;
+    if(fstat(global_shared_allocator::shm_fd(), &st)) throw std::system_error(errno, std::system_category(), "fstat");
+    grain_ = std::max<size_t>(st.st_blksize, getpagesize());
+    capacity_ = (capacity + grain_ - 1) / grain_ * grain_;
+    raw_ = (char *)global_shared_allocator::allocate(capacity_ + grain_);
+    char *data = (char *)(((uintptr_t)raw_ + grain_ - 1) / grain_ * grain_);
+    offset_ = data - (char *)global_shared_allocator::shm_addr();
+    head_ = tail_ = 0;
+  }
+  ~shared_byte_ring() { global_shared_allocator::deallocate(raw_, capacity_ + grain_); }
+  shared_byte_ring(const shared_byte_ring &) = delete;
+  shared_byte_ring &operator=(const shared_byte_ring &) = delete;
+
+  size_t capacity() const { return capacity_; }
+  size_t size() const { return tail_.load() - head_.load(); }  // snapshot
+  bool empty() const { return size() == 0; }
+
+  // Process-local double mapping of a ring.
+  class view {
+  public:
+    explicit view(shared_byte_ring &ring);
+    ~view() { munmap(base_, 2 * ring_->capacity_); }
+    view(const view &) = delete;
+    view &operator=(const view &) = delete;
+
+    // Producer side. Space is invisible to the consumer until committed.
+    char *try_reserve(size_t n);  // NULL if less than n bytes are free
+    char *reserve(size_t n);      // blocks until n bytes are free
+    void commit(size_t n);
+
+    // Consumer side. `n` receives the number of readable bytes.
+    const char *try_peek(size_t &n);            // n may be 0
+    const char *peek(size_t &n, size_t min = 1);  // blocks until n >= min
+    void release(size_t n);
+
+  private:
+    shared_byte_ring *ring_;
+    char *base_;
+  };
+
+private:
+  // Consumer-owned.
+  std::atomic<size_t> head_;
+  char pad0_[shared_cache_line - sizeof(std::atomic<size_t>)];
+
+  // Producer-owned.
+  std::atomic<size_t> tail_;
+  char pad1_[shared_cache_line - sizeof(std::atomic<size_t>)];
+
+  size_t capacity_;
+  size_t grain_;   // mapping granularity of the shm file
+  size_t offset_;  // of the ring pages in the shm file
+  char *raw_;
+
+  shared_event_count readable_, writable_;
+};
+
+inline shared_byte_ring::view::view(shared_byte_ring &ring) : ring_(&ring)
+{
+  size_t c = ring.capacity_;
+  int fd = global_shared_allocator::shm_fd();
+
+  // Reserve the address range, then overlay both halves with the same pages.
+  void *addr = mmap(NULL, 2 * c, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(addr == MAP_FAILED) throw std::system_error(errno, std::system_category(), "mmap");
+  base_ = (char *)addr;
+  for(char *half : {base_, base_ + c}) {
+    if(mmap(half, c, global_shared_allocator::shm_prot(), MAP_SHARED | MAP_FIXED, fd, ring.offset_) == MAP_FAILED) {
+      int e = errno;
+      munmap(base_, 2 * c);
+      throw std::system_error(e, std::system_category(), "mmap");
+    }
+  }
+}
+
+inline char *shared_byte_ring::view::try_reserve(size_t n)
+{
+  size_t t = ring_->tail_.load(std::memory_order_relaxed);
+  if(n > ring_->capacity_ - (t - ring_->head_.load(std::memory_order_acquire))) return NULL;
+  return base_ + t % ring_->capacity_;
+}
+
+inline char *shared_byte_ring::view::reserve(size_t n)
+{
+  if(n > ring_->capacity_) throw std::length_error("reserve: larger than the ring");
+  char *p;
+  while(!(p = try_reserve(n))) ring_->writable_.wait([&] { return ring_->capacity_ - ring_->size() >= n; });
+  return p;
+}
+
+inline void shared_byte_ring::view::commit(size_t n)
+{
+  ring_->tail_.fetch_add(n, std::memory_order_release);
+  ring_->readable_.notify();
+}
+
+inline const char *shared_byte_ring::view::try_peek(size_t &n)
+{
+  size_t h = ring_->head_.load(std::memory_order_relaxed);
+  n = ring_->tail_.load(std::memory_order_acquire) - h;
+  return base_ + h % ring_->capacity_;
+}
+
+inline const char *shared_byte_ring::view::peek(size_t &n, size_t min)
+{
+  if(min > ring_->capacity_) throw std::length_error("peek: larger than the ring");
+  const char *p;
+  while(p = try_peek(n), n < min) ring_->readable_.wait([&] { return ring_->size() >= min; });
+  return p;
+}
+
+inline void shared_byte_ring::view::release(size_t n)
+{
+  ring_->head_.fetch_add(n, std::memory_order_release);
+  ring_->writable_.notify();
+}
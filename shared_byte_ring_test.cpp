@@ -0,0 +1,56 @@
+#include "shared_byte_ring.h"
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <iostream>
+
+using namespace std;
+
+// Records are a length byte followed by that many copies of it.
+static constexpr int n_record = 100000;
+
+int main()
+{
+  global_shared_allocator::shm_open(NULL, O_RDWR | O_CREAT | O_TRUNC);
+  atexit(global_shared_allocator::shm_close);
+  global_shared_allocator::shm_unlink();
+
+  shared_byte_ring &r = *new(shared) shared_byte_ring(1);
+  assert(r.capacity() == (size_t)getpagesize() && r.empty());
+
+  pid_t pid = fork();
+  if(pid < 0) {
+    err(EXIT_FAILURE, "fork");
+  } else if(pid == 0) {  // producer
+    shared_byte_ring::view v(r);
+    for(int i = 0; i < n_record; ++i) {
+      unsigned char len = i % 251 + 1;
+      char *p = v.reserve(len + 1);
+      p[0] = len;
+      memset(p + 1, len, len);
+      v.commit(len + 1);
+    }
+    _exit(0);
+  }
+
+  // Records are read in place, including those crossing the end of the ring.
+  shared_byte_ring::view v(r);
+  for(int i = 0; i < n_record; ++i) {
+    size_t n;
+    const unsigned char *p = (const unsigned char *)v.peek(n);
+    unsigned char len = p[0];
+    assert(len == i % 251 + 1);
+    p = (const unsigned char *)v.peek(n, len + 1);
+    for(int j = 1; j <= len; ++j) assert(p[j] == len);
+    v.release(len + 1);
+  }
+  int status;
+  wait(&status);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  assert(r.empty());
+  cout << "passed" << endl;
+  return 0;
+}
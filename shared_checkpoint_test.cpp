@@ -0,0 +1,109 @@
+#include "shared_allocator.h"
+#include "shared_container.h"
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <system_error>
+#include <iostream>
+
+using namespace std;
+
+typedef shared_map<int, shared_string> map_t;
+static constexpr int n_item = 10000;
+
+static shared_string value(int i)
+{
+  return shared_string("value of a long enough key ") + to_string(i).c_str();
+}
+
+int main()
+{
+  global_shared_allocator::shm_open(NULL, O_RDWR | O_CREAT | O_TRUNC);
+  global_shared_allocator::shm_unlink();
+  void *addr = global_shared_allocator::shm_addr();
+  map_t *m = new(shared) map_t;
+  for(int i = 0; i < n_item; ++i) m->emplace(i, value(i));
+  global_shared_allocator::set_root(m);
+
+  // Another process keeps allocating and growing the heap during checkpoints.
+  auto *stop = new(shared) atomic<int>(0);
+  pid_t pid = fork();
+  if(pid < 0) err(EXIT_FAILURE, "fork");
+  if(pid == 0) {
+    shared_vector<shared_string> v;
+    for(size_t i = 0; !stop->load(); ++i) {
+      v.emplace_back(value(i));
+      if(v.size() > 100000) v.clear();
+    }
+    _exit(0);
+  }
+  char path[64];
+  snprintf(path, sizeof path, "/tmp/shared_checkpoint_test.%d", (int)getpid());
+  for(int i = 0; i < 10; ++i) global_shared_allocator::checkpoint(path);
+  stop->store(1);
+  int status;
+  assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  // Changes after the checkpoint are not in it.
+  m->erase(0);
+  global_shared_allocator::shm_close();
+
+  // Restore into a fresh shared memory object.
+  string name = "shared_checkpoint_test." + to_string(getpid());
+  global_shared_allocator::restore(path, name.c_str());
+  global_shared_allocator::shm_unlink();
+  assert(global_shared_allocator::shm_addr() == addr);
+  assert(global_shared_allocator::shm_oflag() & O_TRUNC);
+  m = (map_t *)global_shared_allocator::root();
+  assert((int)m->size() == n_item);
+  for(int i = 0; i < n_item; ++i) assert(m->at(i) == value(i));
+
+  // The restored heap is fully usable, including space the other process had.
+  for(int i = n_item; i < 4 * n_item; ++i) m->emplace(i, value(i));
+  global_shared_allocator::checkpoint(path);
+  global_shared_allocator::shm_close();
+
+  // Failed restores leave no descriptor behind.
+  int probe = dup(0);
+  close(probe);
+  for(auto restore : {global_shared_allocator::restore, global_shared_allocator::restore_lazy}) {
+    try {
+      restore(path, "no/such/name", 0600);
+      assert(false);
+    } catch(const system_error &) { }
+  }
+  int again = dup(0);
+  assert(again == probe);
+  close(again);
+
+  // Lazy restores: usable before the copy completes. The second one prefetches hot pages.
+  string hot = path + ".hot"s;
+  unlink(hot.c_str());
+  for(int round = 0; round < 2; ++round) {
+    global_shared_allocator::restore_lazy(path, name.c_str());
+    global_shared_allocator::shm_unlink();
+    assert(global_shared_allocator::shm_addr() == addr);
+    if(round == 0) global_shared_allocator::checkpoint(path);  // completes the restore first
+    m = (map_t *)global_shared_allocator::root();
+    assert((int)m->size() == 4 * n_item);
+    for(int i = 0; i < 4 * n_item; i += 7) assert(m->at(i) == value(i));
+    m->emplace(-1, value(-1));
+    global_shared_allocator::restore_wait();
+    for(int i = 0; i < 4 * n_item; ++i) assert(m->at(i) == value(i));
+    if(round == 0) {
+      global_shared_allocator::shm_close();
+      continue;
+    }
+    m->~map_t();
+    operator delete(m, shared);
+    global_shared_allocator::shm_close();
+  }
+  unlink(hot.c_str());
+  unlink(path);
+  cout << "passed" << endl;
+  return 0;
+}
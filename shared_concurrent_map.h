@@ -0,0 +1,489 @@
+/*
+ * Concurrent hash map shared by processes.
+ *
+ * Buckets are guarded by a fixed set of striped spinlocks, so operations on
+ * different stripes never contend. Resizing doubles the bucket array and moves
+ * old buckets over incrementally: every update moves the old bucket of its own
+ * key and helps with one more, so no operation pays for the whole table.
+ *
+ * Lookups take no lock when keys and values are trivially destructible: nodes
+ * are then never changed once linked, updates replace them, and the replaced
+ * nodes and tables are retired to the epoch-based reclamation of the
+ * allocator while readers hold a shared_epoch_guard. Other types are looked
+ * up under the stripe lock, since their destructors cannot be deferred to
+ * whichever process reclaims the memory.
+ *
+ * Values are copied out by find(). Use update() to modify them.
+ *
+ * Written by <lyazj@github.com>.
+ */
+#pragma once
+#include "shared_sync.h"
+#include <mutex>
+#include <utility>
+#include <functional>
+#include <type_traits>
+#include <stddef.h>
+
+template<class K, class V, class H = std::hash<K>, class E = std::equal_to<K>>
+class shared_concurrent_map {
+public:
+  typedef K key_type;
+  typedef V mapped_type;
+  typedef std::pair<const K, V> value_type;
+
+  explicit shared_concurrent_map(size_t buckets = 0);
+  ~shared_concurrent_map();
+  shared_concurrent_map(const shared_concurrent_map &) = delete;
+  shared_concurrent_map &operator=(const shared_concurrent_map &) = delete;
+
+  // Returns false without touching the map if the key exists.
+  bool insert(const K &k, const V &v);
+
+  // Returns true if inserted, false if assigned.
+  bool insert_or_assign(const K &k, const V &v);
+
+  // Copies the value out on success.
+  bool find(const K &k, V &v) const;
+  bool contains(const K &k) const;
+
+  // Calls f(V &) under the bucket lock, on a copy that replaces the value
+  // if reads are lock-free. Returns false if the key does not exist.
+  template<class F> bool update(const K &k, F f);
+
+  bool erase(const K &k);
+
+  // Calls f(const value_type &) for every element, one stripe at a time.
+  // Elements concurrently inserted or erased may or may not be visited.
+  template<class F> void for_each(F f) const;
+
+  size_t size() const { return size_.load(std::memory_order_relaxed); }
+  bool empty() const { return size() == 0; }
+
+private:
+  struct node {
+    std::atomic<node *> next_;
+    size_t hash_;
+    value_type value_;
+    node(node *next, size_t hash, const K &k, const V &v) : next_(next), hash_(hash), value_(k, v) { }
+  };
+
+  struct table {
+    size_t mask_;
+    std::atomic<node *> *buckets_;
+  };
+
+  struct stripe {
+    mutable shared_spinlock lock_;
+    char pad_[shared_cache_line - sizeof(shared_spinlock)];
+  };
+
+  static inline constexpr bool lock_free_reads_ = std::is_trivially_destructible_v<K> && std::is_trivially_destructible_v<V>;
+
+  // Must divide every table size.
+  static inline constexpr size_t n_stripe_ = 64;
+
+  // Resize when size() exceeds #buckets * max_load_.
+  static inline constexpr size_t max_load_ = 2;
+
+  // Marks an old bucket whose nodes have been moved.
+  static node *moved() { return (node *)1; }
+
+  stripe stripes_[n_stripe_];
+  std::atomic<table *> cur_, old_;  // changed only with all stripes locked, old_ first
+  std::atomic<size_t> size_, n_bucket_;
+  std::atomic<size_t> migrate_next_, migrated_;
+  std::atomic<uint32_t> resizing_;
+
+  shared_spinlock &lock_of(size_t hash) const { return stripes_[hash & (n_stripe_ - 1)].lock_; }
+  void lock_all() const { for(const stripe &s : stripes_) s.lock_.lock(); }
+  void unlock_all() const { for(const stripe &s : stripes_) s.lock_.unlock(); }
+
+  static table *make_table(size_t n);
+  static void free_table(table *t);  // immediately: no reader may be left
+  static node *make_node(node *next, size_t hash, const K &k, const V &v);
+  static void dispose(node *n);      // after readers, if they take no lock
+  static void dispose(table *t);
+
+  // The stripe of `hash` must be held.
+  std::atomic<node *> *locate(const K &k, size_t hash);
+  bool migrate(size_t i);  // true if this was the last old bucket
+
+  // With the stripe of `hash` held, or inside an epoch if lock_free_reads_.
+  const node *search(const K &k, size_t hash) const;
+
+  // Called without any stripe held.
+  void after_update(bool finished);
+  void begin_resize();
+  void help_resize();
+  void finish_resize();
+};
+
+template<class K, class V, class H, class E>
+shared_concurrent_map<K, V, H, E>::shared_concurrent_map(size_t buckets)
+  : size_(0), migrate_next_(0), migrated_(0), resizing_(0)
+{
+  size_t n = n_stripe_;
+  while(n < buckets) n <<= 1;
+  n_bucket_.store(n);
+  cur_.store(make_table(n));
+  old_.store(NULL);
+}
+
+template<class K, class V, class H, class E>
+shared_concurrent_map<K, V, H, E>::~shared_concurrent_map()
+{
+  for(table *t : {old_.load(), cur_.load()}) {
+    if(!t) continue;
+    for(size_t i = 0; i <= t->mask_; ++i) {
+      node *n = t->buckets_[i].load();
+      if(n == moved()) continue;
+      while(n) {
+        node *next = n->next_.load();
+        n->~node();
+        shared_allocator<node>().deallocate(n, 1);
+        n = next;
+      }
+    }
+    free_table(t);
+  }
+}
+
+template<class K, class V, class H, class E>
+bool shared_concurrent_map<K, V, H, E>::insert(const K &k, const V &v)
+{
+  size_t h = H()(k);
+  bool finished, inserted;
+  {
+    std::lock_guard<shared_spinlock> l(lock_of(h));
+    table *o = old_.load();
+    finished = o && migrate(h & o->mask_);
+    std::atomic<node *> *p = locate(k, h);
+    inserted = !p->load();
+    if(inserted) {
+      p->store(make_node(NULL, h, k, v));
+      size_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  after_update(finished);
+  return inserted;
+}
+
+template<class K, class V, class H, class E>
+bool shared_concurrent_map<K, V, H, E>::insert_or_assign(const K &k, const V &v)
+{
+  size_t h = H()(k);
+  bool finished, inserted;
+  {
+    std::lock_guard<shared_spinlock> l(lock_of(h));
+    table *o = old_.load();
+    finished = o && migrate(h & o->mask_);
+    std::atomic<node *> *p = locate(k, h);
+    node *n = p->load();
+    inserted = !n;
+    if(inserted) {
+      p->store(make_node(NULL, h, k, v));
+      size_.fetch_add(1, std::memory_order_relaxed);
+    } else if constexpr(lock_free_reads_) {
+      p->store(make_node(n->next_.load(), h, k, v));
+      dispose(n);
+    } else {
+      n->value_.second = v;
+    }
+  }
+  after_update(finished);
+  return inserted;
+}
+
+template<class K, class V, class H, class E>
+bool shared_concurrent_map<K, V, H, E>::find(const K &k, V &v) const
+{
+  size_t h = H()(k);
+  if constexpr(lock_free_reads_) {
+    shared_epoch_guard g;
+    const node *n = search(k, h);
+    if(!n) return false;
+    v = n->value_.second;
+    return true;
+  } else {
+    std::lock_guard<shared_spinlock> l(lock_of(h));
+    const node *n = search(k, h);
+    if(!n) return false;
+    v = n->value_.second;
+    return true;
+  }
+}
+
+template<class K, class V, class H, class E>
+bool shared_concurrent_map<K, V, H, E>::contains(const K &k) const
+{
+  size_t h = H()(k);
+  if constexpr(lock_free_reads_) {
+    shared_epoch_guard g;
+    return search(k, h) != NULL;
+  } else {
+    std::lock_guard<shared_spinlock> l(lock_of(h));
+    return search(k, h) != NULL;
+  }
+}
+
+template<class K, class V, class H, class E>
+template<class F>
+bool shared_concurrent_map<K, V, H, E>::update(const K &k, F f)
+{
+  size_t h = H()(k);
+  bool finished, found;
+  {
+    std::lock_guard<shared_spinlock> l(lock_of(h));
+    table *o = old_.load();
+    finished = o && migrate(h & o->mask_);
+    std::atomic<node *> *p = locate(k, h);
+    node *n = p->load();
+    found = n != NULL;
+    if(found) {
+      if constexpr(lock_free_reads_) {
+        node *c = make_node(n->next_.load(), h, k, n->value_.second);
+        try {
+          f(c->value_.second);
+        } catch(...) {
+          c->~node();
+          shared_allocator<node>().deallocate(c, 1);
+          throw;
+        }
+        p->store(c);
+        dispose(n);
+      } else {
+        f(n->value_.second);
+      }
+    }
+  }
+  after_update(finished);
+  return found;
+}
+
+template<class K, class V, class H, class E>
+bool shared_concurrent_map<K, V, H, E>::erase(const K &k)
+{
+  size_t h = H()(k);
+  bool finished, erased;
+  {
+    std::lock_guard<shared_spinlock> l(lock_of(h));
+    table *o = old_.load();
+    finished = o && migrate(h & o->mask_);
+    std::atomic<node *> *p = locate(k, h);
+    node *n = p->load();
+    erased = n != NULL;
+    if(erased) {
+      p->store(n->next_.load());
+      dispose(n);
+      size_.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+  after_update(finished);
+  return erased;
+}
+
+template<class K, class V, class H, class E>
+template<class F>
+void shared_concurrent_map<K, V, H, E>::for_each(F f) const
+{
+  for(size_t s = 0; s < n_stripe_; ++s) {
+    std::lock_guard<shared_spinlock> l(stripes_[s].lock_);
+    for(const table *t : {old_.load(), cur_.load()}) {
+      if(!t) continue;
+      for(size_t i = s; i <= t->mask_; i += n_stripe_) {
+        const node *n = t->buckets_[i].load();
+        if(n == moved()) continue;
+        for(; n; n = n->next_.load()) f(n->value_);
+      }
+    }
+  }
+}
+
+template<class K, class V, class H, class E>
+typename shared_concurrent_map<K, V, H, E>::table *shared_concurrent_map<K, V, H, E>::make_table(size_t n)
+{
+  table *t = shared_allocator<table>().allocate(1);
+  try {
+    t->buckets_ = shared_allocator<std::atomic<node *>>().allocate(n);
+  } catch(...) {
+    shared_allocator<table>().deallocate(t, 1);
+    throw;
+  }
+  for(size_t i = 0; i < n; ++i) new(&t->buckets_[i]) std::atomic<node *>(NULL);
+  t->mask_ = n - 1;
+  return t;
+}
+
+template<class K, class V, class H, class E>
+void shared_concurrent_map<K, V, H, E>::free_table(table *t)
+{
+  shared_allocator<std::atomic<node *>>().deallocate(t->buckets_, t->mask_ + 1);
+  shared_allocator<table>().deallocate(t, 1);
+}
+
+template<class K, class V, class H, class E>
+typename shared_concurrent_map<K, V, H, E>::node *shared_concurrent_map<K, V, H, E>::make_node(node *next, size_t hash, const K &k, const V &v)
+{
+  node *n = shared_allocator<node>().allocate(1);
+  try {
+    new(n) node(next, hash, k, v);
+  } catch(...) {
+    shared_allocator<node>().deallocate(n, 1);
+    throw;
+  }
+  return n;
+}
+
+template<class K, class V, class H, class E>
+void shared_concurrent_map<K, V, H, E>::dispose(node *n)
+{
+  n->~node();
+  if constexpr(lock_free_reads_) {
+    global_shared_allocator::retire(n, sizeof(node));
+  } else {
+    shared_allocator<node>().deallocate(n, 1);
+  }
+}
+
+template<class K, class V, class H, class E>
+void shared_concurrent_map<K, V, H, E>::dispose(table *t)
+{
+  if constexpr(lock_free_reads_) {
+    global_shared_allocator::retire(t->buckets_, (t->mask_ + 1) * sizeof(std::atomic<node *>));
+    global_shared_allocator::retire(t, sizeof(table));
+  } else {
+    free_table(t);
+  }
+}
+
+template<class K, class V, class H, class E>
+std::atomic<typename shared_concurrent_map<K, V, H, E>::node *> *shared_concurrent_map<K, V, H, E>::locate(const K &k, size_t hash)
+{
+  table *c = cur_.load();
+  std::atomic<node *> *p = &c->buckets_[hash & c->mask_];
+  for(node *n; (n = p->load(std::memory_order_relaxed)) && !(n->hash_ == hash && E()(n->value_.first, k));) p = &n->next_;
+  return p;
+}
+
+template<class K, class V, class H, class E>
+const typename shared_concurrent_map<K, V, H, E>::node *shared_concurrent_map<K, V, H, E>::search(const K &k, size_t hash) const
+{
+  // Lookups do not move buckets: search the old table if it still owns the key.
+  // cur_ is loaded before old_, which is set before cur_ when a resize begins.
+  // If the table loaded as current has become old meanwhile and the bucket
+  // has been moved, start over.
+  for(;;) {
+    const table *c = cur_.load(), *o = old_.load();
+    const node *n = o ? o->buckets_[hash & o->mask_].load() : NULL;
+    if(!n || n == moved()) n = c->buckets_[hash & c->mask_].load();
+    if(n == moved()) continue;
+    while(n && !(n->hash_ == hash && E()(n->value_.first, k))) n = n->next_.load();
+    return n;
+  }
+}
+
+template<class K, class V, class H, class E>
+bool shared_concurrent_map<K, V, H, E>::migrate(size_t i)
+{
+  table *o = old_.load(), *c = cur_.load();
+  node *n = o->buckets_[i].load();
+  if(n == moved()) return false;
+  if constexpr(lock_free_reads_) {
+    // Readers may be walking the old chain: link copies, then retire the originals.
+    node *copies = NULL;
+    try {
+      for(node *p = n; p; p = p->next_.load()) copies = make_node(copies, p->hash_, p->value_.first, p->value_.second);
+    } catch(...) {
+      while(copies) {
+        node *next = copies->next_.load();
+        copies->~node();
+        shared_allocator<node>().deallocate(copies, 1);
+        copies = next;
+      }
+      throw;
+    }
+    while(copies) {
+      node *next = copies->next_.load();
+      std::atomic<node *> &b = c->buckets_[copies->hash_ & c->mask_];
+      copies->next_.store(b.load());
+      b.store(copies);
+      copies = next;
+    }
+    o->buckets_[i].store(moved());
+    while(n) {
+      node *next = n->next_.load();
+      dispose(n);
+      n = next;
+    }
+  } else {
+    while(n) {
+      node *next = n->next_.load();
+      std::atomic<node *> &b = c->buckets_[n->hash_ & c->mask_];
+      n->next_.store(b.load());
+      b.store(n);
+      n = next;
+    }
+    o->buckets_[i].store(moved());
+  }
+  return migrated_.fetch_add(1) == o->mask_;
+}
+
+template<class K, class V, class H, class E>
+void shared_concurrent_map<K, V, H, E>::after_update(bool finished)
+{
+  if(finished) return finish_resize();
+  if(resizing_.load(std::memory_order_relaxed)) return help_resize();
+  if(size() > n_bucket_.load(std::memory_order_relaxed) * max_load_) begin_resize();
+}
+
+template<class K, class V, class H, class E>
+void shared_concurrent_map<K, V, H, E>::begin_resize()
+{
+  if(resizing_.exchange(1)) return;
+  lock_all();
+  if(size() <= n_bucket_.load() * max_load_) {  // someone else did it
+    unlock_all();
+    resizing_.store(0);
+    return;
+  }
+  table *t;
+  try {
+    t = make_table(2 * (cur_.load()->mask_ + 1));
+  } catch(...) {
+    unlock_all();
+    resizing_.store(0);
+    throw;
+  }
+  old_.store(cur_.load());
+  cur_.store(t);
+  n_bucket_.store(t->mask_ + 1);
+  migrate_next_.store(0);
+  migrated_.store(0);
+  unlock_all();
+}
+
+template<class K, class V, class H, class E>
+void shared_concurrent_map<K, V, H, E>::help_resize()
+{
+  // Wrapping around makes sure stragglers are eventually visited.
+  size_t i = migrate_next_.fetch_add(1);
+  bool finished;
+  {
+    std::lock_guard<shared_spinlock> l(stripes_[i & (n_stripe_ - 1)].lock_);
+    table *o = old_.load();
+    if(!o) return;
+    finished = migrate(i & o->mask_);
+  }
+  if(finished) finish_resize();
+}
+
+template<class K, class V, class H, class E>
+void shared_concurrent_map<K, V, H, E>::finish_resize()
+{
+  lock_all();
+  table *o = old_.exchange(NULL);
+  unlock_all();
+  dispose(o);
+  resizing_.store(0);
+}
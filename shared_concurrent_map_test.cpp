@@ -0,0 +1,69 @@
+#include "shared_concurrent_map.h"
+#include "shared_container.h"
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <iostream>
+
+using namespace std;
+
+static constexpr int n_writer = 4, n_reader = 4, n_key = 50000;
+static shared_concurrent_map<int, long> *m;
+
+int main()
+{
+  global_shared_allocator::shm_open(NULL, O_RDWR | O_CREAT | O_TRUNC);
+  atexit(global_shared_allocator::shm_close);
+  global_shared_allocator::shm_unlink();
+  m = new(shared) shared_concurrent_map<int, long>;
+
+  // Writers insert disjoint keys, grow the table several times and erase the odd ones.
+  // Readers only see values consistent with their keys.
+  for(int w = 0; w < n_writer + n_reader; ++w) {
+    pid_t pid = fork();
+    if(pid < 0) err(EXIT_FAILURE, "fork");
+    if(pid) continue;
+    if(w < n_writer) {
+      for(int k = w; k < n_key; k += n_writer) assert(m->insert(k, 2L * k));
+      for(int k = w; k < n_key; k += n_writer) assert(!m->insert(k, 0));
+      for(int k = w; k < n_key; k += n_writer) if(k % 2) assert(m->erase(k));
+      for(int k = w; k < n_key; k += n_writer) if(k % 4 == 0) assert(m->update(k, [](long &v) { v += 1; }));
+    } else {
+      for(int i = 0; i < 4 * n_key; ++i) {
+        long v;
+        int k = rand() % n_key;
+        if(m->find(k, v)) assert(v == 2L * k || v == 2L * k + 1);
+      }
+    }
+    _exit(0);
+  }
+  int status;
+  while(wait(&status) > 0) assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  assert((int)m->size() == n_key / 2);
+  for(int k = 0; k < n_key; ++k) {
+    long v;
+    assert(m->find(k, v) == !(k % 2));
+    if(k % 2 == 0) assert(v == 2L * k + (k % 4 == 0));
+  }
+  size_t n = 0;
+  m->for_each([&](const pair<const int, long> &) { ++n; });
+  assert(n == m->size());
+  assert(!m->insert_or_assign(0, 7) && m->insert_or_assign(1, 7));
+  m->~shared_concurrent_map();
+  operator delete(m, shared);
+
+  // Values with destructors are read under the stripe locks instead.
+  auto *ms = new(shared) shared_concurrent_map<int, shared_string>;
+  for(int k = 0; k < 1000; ++k) assert(ms->insert(k, to_string(k).c_str()));
+  for(int k = 0; k < 1000; k += 2) assert(ms->erase(k));
+  assert(ms->update(1, [](shared_string &v) { v += "!"; }) && !ms->insert_or_assign(3, "three"));
+  shared_string s;
+  assert(ms->find(1, s) && s == "1!" && ms->find(3, s) && s == "three" && !ms->contains(2) && ms->size() == 500);
+  ms->~shared_concurrent_map();
+  operator delete(ms, shared);
+  cout << "passed" << endl;
+  return 0;
+}
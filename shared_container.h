@@ -58,3 +58,12 @@ using shared_stack = std::stack<T, C>;
 
 template<class T, class S = shared_vector<T>, class C = std::less<T>>
 using shared_priority_queue = std::priority_queue<T, S, C>;
+
+// Key extractors for the set and map flavours of non-std containers.
+struct shared_identity_key {
+  template<class T> const T &operator()(const T &v) const { return v; }
+};
+
+struct shared_first_key {
+  template<class P> const typename P::first_type &operator()(const P &v) const { return v.first; }
+};
@@ -0,0 +1,122 @@
+#include "shared_sync.h"
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <thread>
+#include <vector>
+#include <iostream>
+
+using namespace std;
+
+// A writer rewrites `value` when it reuses the memory of a freed node.
+struct node {
+  long value;
+};
+
+static constexpr int n_reader = 4, n_update = 20000;
+static atomic<node *> *head;
+
+int main()
+{
+  global_shared_allocator::shm_open(NULL, O_RDWR | O_CREAT | O_TRUNC);
+  atexit(global_shared_allocator::shm_close);
+  global_shared_allocator::shm_unlink();
+
+  // Retired memory is not reused until the readers that may hold it have left.
+  head = new(shared) atomic<node *>(new(shared) node{0});
+  for(int p = 0; p < n_reader; ++p) {
+    pid_t pid = fork();
+    if(pid < 0) err(EXIT_FAILURE, "fork");
+    if(pid) continue;
+    for(long last = 0; last < n_update - 1;) {
+      shared_epoch_guard g;
+      node *n = head->load();
+      long v = n->value;
+      assert(v >= last);
+      sched_yield();  // let the writer run
+      assert(n->value == v);
+      last = v;
+    }
+    _exit(0);
+  }
+  for(long v = 1; v < n_update; ++v) {
+    node *n = new(shared) node{-1};
+    n->value = v;
+    if(v % 16 == 0) sched_yield();
+    global_shared_allocator::retire(head->exchange(n), sizeof(node));
+  }
+  int status;
+  while(wait(&status) > 0) assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  // Without readers, reclaim() frees everything.
+  node *n = head->exchange(NULL);
+  global_shared_allocator::retire(n, sizeof(node));
+  global_shared_allocator::reclaim();
+  node *m = new(shared) node{0};
+  assert(m == n);
+
+  // A reader dying inside does not hold memory forever.
+  pid_t pid = fork();
+  if(pid == 0) {
+    global_shared_allocator::epoch_enter();
+    _exit(0);
+  }
+  waitpid(pid, &status, 0);
+  global_shared_allocator::retire(m, sizeof(node));
+  global_shared_allocator::synchronize();
+  global_shared_allocator::reclaim();
+  assert(new(shared) node{0} == m);
+
+  // Nor does one not reaped yet, a zombie that kill() still finds.
+  pid = fork();
+  if(pid == 0) {
+    global_shared_allocator::epoch_enter();
+    _exit(0);
+  }
+  siginfo_t info;
+  assert(waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == 0);
+  global_shared_allocator::retire(m, sizeof(node));
+  global_shared_allocator::synchronize();
+  global_shared_allocator::reclaim();
+  assert(new(shared) node{0} == m);
+  waitpid(pid, &status, 0);
+
+  // Threads of later rounds race to recycle the slots of earlier, dead ones (more threads than
+  // slots in all), while reclamation runs on: their announcements must not be lost.
+  head->store(new(shared) node{0});
+  atomic<bool> stop(false);
+  thread writer([&] {
+    for(long v = 1; !stop; ++v) {
+      node *n = new(shared) node{-1};
+      n->value = v;
+      global_shared_allocator::retire(head->exchange(n), sizeof(node));
+    }
+  });
+  for(int round = 0; round < 160; ++round) {
+    vector<thread> ts;
+    for(int i = 0; i < 8; ++i) {
+      ts.emplace_back([] {
+        for(int j = 0; j < 50; ++j) {
+          shared_epoch_guard g;
+          node *n = head->load();
+          long v = n->value;
+          sched_yield();
+          assert(n->value == v);
+        }
+      });
+    }
+    for(thread &t : ts) t.join();
+  }
+  stop = true;
+  writer.join();
+
+  // Nested guards.
+  {
+    shared_epoch_guard a;
+    shared_epoch_guard b;
+  }
+  cout << "passed" << endl;
+  return 0;
+}
@@ -0,0 +1,107 @@
+#include "shared_allocator.h"
+#include "shared_container.h"
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <iostream>
+
+using namespace std;
+
+typedef shared_map<int, shared_string> map_t;
+static constexpr int n_item = 10000;
+static char path[64];
+
+static shared_string value(int i)
+{
+  return shared_string("value of a long enough key ") + to_string(i).c_str();
+}
+
+// A restarted process: reopen, check everything left by the previous run, then add more.
+static int restart(int round)
+{
+  global_shared_allocator::file_open(path, O_RDWR);
+  map_t *m = (map_t *)global_shared_allocator::root();
+  assert(m && (int)m->size() == n_item * round);
+  for(int i = 0; i < n_item * round; ++i) assert(m->at(i) == value(i));
+  for(int i = n_item * round; i < n_item * (round + 1); ++i) m->emplace(i, value(i));
+
+  // Reclamation works again after recovery.
+  global_shared_allocator::epoch_enter();
+  void *p = global_shared_allocator::allocate(100);
+  global_shared_allocator::retire(p, 100);
+  global_shared_allocator::epoch_leave();
+  global_shared_allocator::synchronize();
+  global_shared_allocator::reclaim();
+
+  global_shared_allocator::flush();
+  global_shared_allocator::shm_close();
+  return 0;
+}
+
+static void run(const char *self, int round)
+{
+  pid_t pid = fork();
+  if(pid < 0) err(EXIT_FAILURE, "fork");
+  if(pid == 0) {
+    // exec for a fresh address space, as after a real restart.
+    string r = to_string(round);
+    execl(self, self, path, r.c_str(), (char *)NULL);
+    _exit(127);
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc == 3) {
+    strcpy(path, argv[1]);
+    return restart(atoi(argv[2]));
+  }
+  snprintf(path, sizeof path, "/tmp/shared_file_test.%d", (int)getpid());
+
+  // First run: build the data and record the root.
+  global_shared_allocator::file_open(path, O_RDWR | O_CREAT | O_TRUNC);
+  void *addr = global_shared_allocator::shm_addr();
+  map_t *m = new(shared) map_t;
+  for(int i = 0; i < n_item; ++i) m->emplace(i, value(i));
+  global_shared_allocator::set_root(m);
+  global_shared_allocator::flush(m, sizeof *m);
+
+  // A second process attaches while we are open; it must not recover (reset) anything.
+  pid_t pid = fork();
+  if(pid < 0) err(EXIT_FAILURE, "fork");
+  if(pid == 0) {
+    global_shared_allocator::shm_close();
+    global_shared_allocator::file_open(path, O_RDWR);
+    assert(global_shared_allocator::shm_addr() == addr);
+    map_t *m = (map_t *)global_shared_allocator::root();
+    assert(m->at(n_item - 1) == value(n_item - 1));
+    global_shared_allocator::shm_close();
+    _exit(0);
+  }
+  int status;
+  assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  global_shared_allocator::shm_close();
+
+  // Warm restarts.
+  run(argv[0], 1);
+  run(argv[0], 2);
+
+  global_shared_allocator::file_open(path, O_RDWR);
+  assert(global_shared_allocator::shm_addr() == addr);
+  m = (map_t *)global_shared_allocator::root();
+  assert((int)m->size() == n_item * 3);
+  for(int i = 0; i < n_item * 3; ++i) assert(m->at(i) == value(i));
+  m->~map_t();
+  operator delete(m, shared);
+  global_shared_allocator::shm_close();
+  global_shared_allocator::shm_unlink();
+  assert(access(path, F_OK) < 0);
+  cout << "passed" << endl;
+  return 0;
+}
@@ -0,0 +1,361 @@
+/*
+ * Open-addressing hash containers with elements stored inline.
+ *
+ * Control bytes and slots share a single shared allocation. Each control byte
+ * holds 7 bits of the hash of a full slot, so a probe compares a group of 16
+ * slots at once (SSE2 when available) and touches slot memory only on likely
+ * matches. Like std containers, they need external locking across processes.
+ *
+ * Capacities are 2^n - 1. The control bytes are followed by a sentinel, which
+ * stops iteration, and by a copy of the first group minus one byte, so a group
+ * may start anywhere.
+ *
+ * Written by <lyazj@github.com>.
+ */
+#pragma once
+#include "shared_container.h"
+#include <utility>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <stdint.h>
+#include <stddef.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// A group of 16 control bytes.
+class shared_flat_hash_group {
+public:
+  static inline constexpr size_t width = 16;
+  static inline constexpr int8_t empty = -128, deleted = -2, sentinel = -1;  // full: 0..127
+
+  explicit shared_flat_hash_group(const int8_t *ctrl)
+  {
+#ifdef __SSE2__
+    ctrl_ = _mm_loadu_si128((const __m128i *)ctrl);
+#else
+    ctrl_ = ctrl;
+#endif
+  }
+
+  // Bit i is set if ctrl[i] satisfies the condition.
+  uint32_t match(int8_t h2) const
+  {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl_, _mm_set1_epi8(h2)));
+#else
+    uint32_t m = 0;
+    for(size_t i = 0; i < width; ++i) m |= (uint32_t)(ctrl_[i] == h2) << i;
+    return m;
+#endif
+  }
+  uint32_t match_empty() const { return match(empty); }
+  uint32_t match_empty_or_deleted() const
+  {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), ctrl_));
+#else
+    uint32_t m = 0;
+    for(size_t i = 0; i < width; ++i) m |= (uint32_t)(ctrl_[i] < -1) << i;
+    return m;
+#endif
+  }
+
+private:
+#ifdef __SSE2__
+  __m128i ctrl_;
+#else
+  const int8_t *ctrl_;
+#endif
+};
+
+// The common implementation. KeyOf extracts the key from a value.
+template<class K, class T, class KeyOf, class H, class E>
+class shared_flat_hash_table {
+public:
+  typedef K key_type;
+  typedef T value_type;
+  typedef size_t size_type;
+
+  template<bool Const> class basic_iterator {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef T value_type;
+    typedef ptrdiff_t difference_type;
+    typedef std::conditional_t<Const, const T, T> *pointer;
+    typedef std::conditional_t<Const, const T, T> &reference;
+
+    basic_iterator() : ctrl_(NULL), slot_(NULL) { }
+    template<bool C, class = std::enable_if_t<Const && !C>>
+    basic_iterator(const basic_iterator<C> &it) : ctrl_(it.ctrl_), slot_(it.slot_) { }
+
+    reference operator*() const { return *slot_; }
+    pointer operator->() const { return slot_; }
+    basic_iterator &operator++() { ++ctrl_; ++slot_; skip(); return *this; }
+    basic_iterator operator++(int) { basic_iterator it = *this; ++*this; return it; }
+    friend bool operator==(const basic_iterator &a, const basic_iterator &b) { return a.slot_ == b.slot_; }
+    friend bool operator!=(const basic_iterator &a, const basic_iterator &b) { return a.slot_ != b.slot_; }
+
+  private:
+    friend class shared_flat_hash_table;
+    template<bool> friend class basic_iterator;
+    const int8_t *ctrl_;
+    T *slot_;
+    basic_iterator(const int8_t *ctrl, T *slot) : ctrl_(ctrl), slot_(slot) { skip(); }
+    void skip() { while(*ctrl_ < shared_flat_hash_group::sentinel) { ++ctrl_; ++slot_; } }
+  };
+  typedef basic_iterator<false> iterator;
+  typedef basic_iterator<true> const_iterator;
+
+  explicit shared_flat_hash_table(size_t n = 0) : ctrl_(NULL), slots_(NULL), capacity_(0), size_(0), growth_left_(0)
+  {
+    if(n) reserve(n);
+  }
+  shared_flat_hash_table(const shared_flat_hash_table &o) : shared_flat_hash_table(o.size())
+  {
+    for(const T &v : o) emplace_unique(hash(KeyOf()(v)), v);
+  }
+  shared_flat_hash_table(shared_flat_hash_table &&o) noexcept : shared_flat_hash_table() { swap(o); }
+  shared_flat_hash_table &operator=(shared_flat_hash_table o) { swap(o); return *this; }
+  ~shared_flat_hash_table() { destroy(); }
+
+  void swap(shared_flat_hash_table &o) noexcept
+  {
+    std::swap(ctrl_, o.ctrl_);
+    std::swap(slots_, o.slots_);
+    std::swap(capacity_, o.capacity_);
+    std::swap(size_, o.size_);
+    std::swap(growth_left_, o.growth_left_);
+  }
+
+  iterator begin() { return capacity_ ? iterator(ctrl_, slots_) : end(); }
+  iterator end() { iterator it; it.slot_ = slots_ + capacity_; return it; }
+  const_iterator begin() const { return ((shared_flat_hash_table *)this)->begin(); }
+  const_iterator end() const { return ((shared_flat_hash_table *)this)->end(); }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  size_t capacity() const { return capacity_; }
+
+  iterator find(const K &k)
+  {
+    size_t h = hash(k);
+    size_t i = find_index(k, h);
+    return i == npos ? end() : at_index(i);
+  }
+  const_iterator find(const K &k) const { return ((shared_flat_hash_table *)this)->find(k); }
+  bool contains(const K &k) const { return find(k) != end(); }
+  size_t count(const K &k) const { return contains(k); }
+
+  template<class... Args> std::pair<iterator, bool> emplace(Args &&...args)
+  {
+    T v(std::forward<Args>(args)...);
+    return insert(std::move(v));
+  }
+  std::pair<iterator, bool> insert(const T &v) { return insert_value(v); }
+  std::pair<iterator, bool> insert(T &&v) { return insert_value(std::move(v)); }
+  template<class It> void insert(It first, It last) { for(; first != last; ++first) insert(*first); }
+
+  size_t erase(const K &k)
+  {
+    size_t i = find_index(k, hash(k));
+    if(i == npos) return 0;
+    erase_index(i);
+    return 1;
+  }
+  iterator erase(const_iterator it)
+  {
+    size_t i = it.slot_ - slots_;
+    erase_index(i);
+    return at_index(i + 1);
+  }
+
+  void clear()
+  {
+    for(size_t i = 0; i < capacity_; ++i) if(ctrl_[i] >= 0) slots_[i].~T();
+    size_ = 0;
+    if(capacity_) reset_ctrl();
+  }
+
+  // Make room for n elements without rehashing.
+  void reserve(size_t n)
+  {
+    size_t c = group_ - 1;
+    while(c - c / 8 < n) c = 2 * c + 1;
+    if(c > capacity_) resize(c);
+  }
+  void rehash(size_t n) { reserve(std::max(n, size_)); }
+
+protected:
+  static inline constexpr size_t group_ = shared_flat_hash_group::width;
+  static inline constexpr size_t npos = -1;
+
+  static size_t hash(const K &k)
+  {
+    // Fold a 128-bit product so that both halves of the hash are well mixed.
+    unsigned __int128 r = (unsigned __int128)H()(k) * 0x9e3779b97f4a7c15ull;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+  }
+  static size_t h1(size_t h) { return h >> 7; }
+  static int8_t h2(size_t h) { return h & 0x7f; }
+
+  iterator at_index(size_t i) { return iterator(ctrl_ + i, slots_ + i); }
+
+  size_t find_index(const K &k, size_t h) const
+  {
+    if(!capacity_) return npos;
+    size_t mask = capacity_, pos = h1(h) & mask;
+    for(size_t step = group_;; pos = (pos + step) & mask, step += group_) {
+      shared_flat_hash_group g(ctrl_ + pos);
+      for(uint32_t m = g.match(h2(h)); m; m &= m - 1) {
+        size_t i = (pos + __builtin_ctz(m)) & mask;
+        if(E()(KeyOf()(slots_[i]), k)) return i;
+      }
+      if(g.match_empty()) return npos;
+    }
+  }
+
+  // The first empty or deleted slot on the probe sequence.
+  size_t find_free(size_t h) const
+  {
+    size_t mask = capacity_, pos = h1(h) & mask;
+    for(size_t step = group_;; pos = (pos + step) & mask, step += group_) {
+      uint32_t m = shared_flat_hash_group(ctrl_ + pos).match_empty_or_deleted();
+      if(m) return (pos + __builtin_ctz(m)) & mask;
+    }
+  }
+
+  template<class V> std::pair<iterator, bool> insert_value(V &&v)
+  {
+    size_t h = hash(KeyOf()(v));
+    size_t i = find_index(KeyOf()(v), h);
+    if(i != npos) return {at_index(i), false};
+    return {at_index(emplace_unique(h, std::forward<V>(v))), true};
+  }
+
+  // The key must not exist.
+  template<class... Args> size_t emplace_unique(size_t h, Args &&...args)
+  {
+    size_t i = capacity_ ? find_free(h) : npos;
+    if(i == npos || (growth_left_ == 0 && ctrl_[i] == shared_flat_hash_group::empty)) {
+      grow();
+      i = find_free(h);
+    }
+    new(&slots_[i]) T(std::forward<Args>(args)...);
+    if(ctrl_[i] == shared_flat_hash_group::empty) --growth_left_;
+    set_ctrl(i, h2(h));
+    ++size_;
+    return i;
+  }
+
+  void erase_index(size_t i)
+  {
+    slots_[i].~T();
+    set_ctrl(i, shared_flat_hash_group::deleted);
+    --size_;
+  }
+
+  void set_ctrl(size_t i, int8_t c)
+  {
+    ctrl_[i] = c;
+    if(i < group_ - 1) ctrl_[capacity_ + 1 + i] = c;
+  }
+
+  void reset_ctrl()
+  {
+    std::fill(ctrl_, ctrl_ + capacity_ + group_, shared_flat_hash_group::empty);
+    ctrl_[capacity_] = shared_flat_hash_group::sentinel;
+    growth_left_ = capacity_ - capacity_ / 8 - size_;
+  }
+
+  // Drop tombstones in place if they take much space, double otherwise.
+  void grow()
+  {
+    if(capacity_ && size_ <= (capacity_ - capacity_ / 8) / 2) resize(capacity_);
+    else resize(capacity_ ? 2 * capacity_ + 1 : group_ - 1);
+  }
+
+  // Control bytes, padded to keep slots aligned, then slots.
+  static size_t ctrl_bytes(size_t c) { return (c + group_ + 15) & ~(size_t)15; }
+  static size_t alloc_bytes(size_t c) { return ctrl_bytes(c) + c * sizeof(T); }
+
+  void resize(size_t c)
+  {
+    static_assert(alignof(T) <= 16, "over-aligned slots are not supported");
+    int8_t *old_ctrl = ctrl_;
+    T *old_slots = slots_;
+    size_t old_capacity = capacity_;
+
+    ctrl_ = (int8_t *)shared_allocator<char>().allocate(alloc_bytes(c));
+    slots_ = (T *)((char *)ctrl_ + ctrl_bytes(c));
+    capacity_ = c;
+    size_ = 0;
+    reset_ctrl();
+    for(size_t i = 0; i < old_capacity; ++i) {
+      if(old_ctrl[i] < 0) continue;
+      emplace_unique(hash(KeyOf()(old_slots[i])), std::move(old_slots[i]));
+      old_slots[i].~T();
+    }
+    if(old_ctrl) shared_allocator<char>().deallocate((char *)old_ctrl, alloc_bytes(old_capacity));
+  }
+
+  void destroy()
+  {
+    if(!ctrl_) return;
+    clear();
+    shared_allocator<char>().deallocate((char *)ctrl_, alloc_bytes(capacity_));
+    ctrl_ = NULL;
+    slots_ = NULL;
+    capacity_ = growth_left_ = 0;
+  }
+
+  int8_t *ctrl_;
+  T *slots_;
+  size_t capacity_, size_, growth_left_;
+};
+
+template<class K, class H = std::hash<K>, class E = std::equal_to<K>>
+class shared_flat_hash_set : public shared_flat_hash_table<K, K, shared_identity_key, H, E> {
+  typedef shared_flat_hash_table<K, K, shared_identity_key, H, E> base;
+public:
+  using base::base;
+  shared_flat_hash_set(std::initializer_list<K> l) : base(l.size()) { base::insert(l.begin(), l.end()); }
+};
+
+// Unlike std::unordered_map, references are invalidated by rehashing.
+// Keys must not be modified through iterators.
+template<class K, class V, class H = std::hash<K>, class E = std::equal_to<K>>
+class shared_flat_hash_map : public shared_flat_hash_table<K, std::pair<K, V>, shared_first_key, H, E> {
+  typedef shared_flat_hash_table<K, std::pair<K, V>, shared_first_key, H, E> base;
+public:
+  typedef V mapped_type;
+  using base::base;
+  shared_flat_hash_map(std::initializer_list<std::pair<K, V>> l) : base(l.size()) { base::insert(l.begin(), l.end()); }
+
+  template<class... Args> std::pair<typename base::iterator, bool> try_emplace(const K &k, Args &&...args)
+  {
+    size_t h = base::hash(k);
+    size_t i = base::find_index(k, h);
+    if(i != base::npos) return {base::at_index(i), false};
+    i = base::emplace_unique(h, std::piecewise_construct, std::forward_as_tuple(k), std::forward_as_tuple(std::forward<Args>(args)...));
+    return {base::at_index(i), true};
+  }
+  template<class M> std::pair<typename base::iterator, bool> insert_or_assign(const K &k, M &&m)
+  {
+    auto r = try_emplace(k, std::forward<M>(m));
+    if(!r.second) r.first->second = std::forward<M>(m);
+    return r;
+  }
+
+  V &operator[](const K &k) { return try_emplace(k).first->second; }
+  V &at(const K &k)
+  {
+    auto it = base::find(k);
+    if(it == base::end()) throw std::out_of_range("shared_flat_hash_map::at");
+    return it->second;
+  }
+  const V &at(const K &k) const { return ((shared_flat_hash_map *)this)->at(k); }
+};
@@ -0,0 +1,68 @@
+#include "shared_flat_hash_map.h"
+#include "shared_container.h"
+#include <unordered_map>
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <iostream>
+
+using namespace std;
+
+int main()
+{
+  srand(time(NULL));
+  global_shared_allocator::shm_open(NULL, O_RDWR | O_CREAT | O_TRUNC);
+  atexit(global_shared_allocator::shm_close);
+  global_shared_allocator::shm_unlink();
+
+  // Reference.
+  unordered_map<int, int> v;
+
+  // Perform the same operations randomly to v and m, with many tombstones.
+  shared_flat_hash_map<int, shared_string> &m = *new(shared) shared_flat_hash_map<int, shared_string>;
+  for(int i = 0; i < 200000; ++i) {
+    int k = rand() % 5000;
+    if(rand() % 3) {
+      bool inserted = v.emplace(k, i).second;
+      assert(m.try_emplace(k, to_string(i).c_str()).second == inserted);
+    } else {
+      assert(m.erase(k) == v.erase(k));
+    }
+  }
+  assert(m.size() == v.size());
+  size_t n = 0;
+  for(auto &[k, s] : m) {
+    assert(s == to_string(v.at(k)).c_str());
+    ++n;
+  }
+  assert(n == v.size());
+
+  shared_flat_hash_set<long> &s = *new(shared) shared_flat_hash_set<long>{1, 2, 3};
+  assert(s.size() == 3 && s.contains(2) && !s.contains(4));
+
+  pid_t pid = fork();
+  if(pid < 0) {
+    err(EXIT_FAILURE, "fork");
+  } else if(pid == 0) {  // child
+    // Look up and modify in another process.
+    for(auto &[k, i] : v) assert(m.at(k) == to_string(i).c_str());
+    for(auto it = m.begin(); it != m.end();) {
+      if(it->first % 2) it = m.erase(it); else ++it;
+    }
+    for(long i = 0; i < 1000; ++i) s.insert(i);
+    _exit(0);
+  }
+  int status;
+  wait(&status);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  for(auto &[k, i] : v) assert(m.contains(k) == !(k % 2));
+  assert(s.size() == 1000);
+  m.clear();
+  assert(m.empty() && m.begin() == m.end());
+  cout << "passed" << endl;
+  return 0;
+}
@@ -0,0 +1,271 @@
+/*
+ * Sorted-vector associative containers for read-mostly shared data.
+ *
+ * Keys (and values) are kept sorted in contiguous shared_vectors. Lookups are
+ * branchless binary searches, bulk construction sorts in parallel and then
+ * removes duplicates, and single insertions or erasures cost O(n) moves.
+ * Like std containers, they need external locking across processes.
+ *
+ * Written by <lyazj@github.com>.
+ */
+#pragma once
+#include "shared_container.h"
+#include <algorithm>
+#include <thread>
+#include <utility>
+#include <iterator>
+#include <functional>
+#include <stdexcept>
+#include <stddef.h>
+
+// Stable sort of a random access range, in parallel threads when it is large.
+template<class It, class C>
+void shared_flat_sort(It first, It last, C comp)
+{
+  size_t n = last - first;
+  size_t n_thread = std::min<size_t>(std::thread::hardware_concurrency(), n >> 14);
+  if(n_thread < 2) return std::stable_sort(first, last, comp);
+
+  // Sort pieces, then merge neighbours pairwise in rounds.
+  std::vector<It> bound;
+  for(size_t i = 0; i <= n_thread; ++i) bound.push_back(first + n * i / n_thread);
+  std::vector<std::thread> threads;
+  for(size_t i = 0; i < n_thread; ++i) {
+    threads.emplace_back([a = bound[i], b = bound[i + 1], comp] { std::stable_sort(a, b, comp); });
+  }
+  for(std::thread &t : threads) t.join();
+  while(bound.size() > 2) {
+    std::vector<It> next;
+    size_t i = 0;
+    threads.clear();
+    for(; i + 2 < bound.size(); i += 2) {
+      threads.emplace_back([a = bound[i], b = bound[i + 1], c = bound[i + 2], comp] { std::inplace_merge(a, b, c, comp); });
+      next.push_back(bound[i]);
+    }
+    next.insert(next.end(), bound.begin() + i, bound.end());  // an odd piece, then `last`
+    for(std::thread &t : threads) t.join();
+    bound.swap(next);
+  }
+}
+
+// The first position in [first, first + n) not less than k. No data-dependent branches.
+template<class It, class K, class C>
+It shared_flat_lower_bound(It first, size_t n, const K &k, C comp)
+{
+  if(n == 0) return first;
+  while(n > 1) {
+    size_t half = n / 2;
+    first = comp(first[half], k) ? first + half : first;
+    n -= half;
+  }
+  return first + comp(*first, k);
+}
+
+template<class K, class C = std::less<K>>
+class shared_flat_set {
+public:
+  typedef K key_type;
+  typedef K value_type;
+  typedef C key_compare;
+  typedef typename shared_vector<K>::const_iterator iterator;
+  typedef iterator const_iterator;
+
+  shared_flat_set() { }
+
+  // Bulk construction from unsorted input with duplicates.
+  template<class It> shared_flat_set(It first, It last) : keys_(first, last) { normalize(); }
+  shared_flat_set(std::initializer_list<K> l) : shared_flat_set(l.begin(), l.end()) { }
+  explicit shared_flat_set(shared_vector<K> keys) : keys_(std::move(keys)) { normalize(); }
+
+  iterator begin() const { return keys_.begin(); }
+  iterator end() const { return keys_.end(); }
+  size_t size() const { return keys_.size(); }
+  bool empty() const { return keys_.empty(); }
+  void clear() { keys_.clear(); }
+  void reserve(size_t n) { keys_.reserve(n); }
+  const shared_vector<K> &keys() const { return keys_; }
+
+  iterator lower_bound(const K &k) const { return shared_flat_lower_bound(begin(), size(), k, C()); }
+  iterator upper_bound(const K &k) const
+  {
+    return shared_flat_lower_bound(begin(), size(), k, [](const K &a, const K &b) { return !C()(b, a); });
+  }
+  iterator find(const K &k) const
+  {
+    iterator it = lower_bound(k);
+    return it == end() || C()(k, *it) ? end() : it;
+  }
+  bool contains(const K &k) const { return find(k) != end(); }
+  size_t count(const K &k) const { return contains(k); }
+
+  std::pair<iterator, bool> insert(const K &k)
+  {
+    iterator it = lower_bound(k);
+    if(it != end() && !C()(k, *it)) return {it, false};
+    return {keys_.insert(it, k), true};
+  }
+  size_t erase(const K &k)
+  {
+    iterator it = find(k);
+    if(it == end()) return 0;
+    keys_.erase(it);
+    return 1;
+  }
+  iterator erase(iterator it) { return keys_.erase(it); }
+
+private:
+  shared_vector<K> keys_;
+
+  void normalize()
+  {
+    shared_flat_sort(keys_.begin(), keys_.end(), C());
+    keys_.erase(std::unique(keys_.begin(), keys_.end(), [](const K &a, const K &b) { return !C()(a, b); }), keys_.end());
+  }
+};
+
+// Keys and values are stored in separate vectors. Iterators yield pairs of references.
+template<class K, class V, class C = std::less<K>>
+class shared_flat_map {
+public:
+  typedef K key_type;
+  typedef V mapped_type;
+  typedef C key_compare;
+
+  template<bool Const> class basic_iterator {
+  public:
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef std::pair<const K &, std::conditional_t<Const, const V, V> &> reference;
+    typedef reference value_type;
+    typedef ptrdiff_t difference_type;
+    struct pointer {
+      reference ref_;
+      reference *operator->() { return &ref_; }
+    };
+    typedef std::conditional_t<Const, const shared_flat_map, shared_flat_map> map_type;
+
+    basic_iterator() : map_(NULL), i_(0) { }
+    basic_iterator(map_type *map, size_t i) : map_(map), i_(i) { }
+    template<bool B, class = std::enable_if_t<Const && !B>>
+    basic_iterator(const basic_iterator<B> &it) : map_(it.map_), i_(it.i_) { }
+
+    reference operator*() const { return {map_->keys_[i_], map_->values_[i_]}; }
+    pointer operator->() const { return {**this}; }
+    reference operator[](ptrdiff_t n) const { return *(*this + n); }
+    basic_iterator &operator++() { ++i_; return *this; }
+    basic_iterator &operator--() { --i_; return *this; }
+    basic_iterator operator++(int) { return basic_iterator(map_, i_++); }
+    basic_iterator operator--(int) { return basic_iterator(map_, i_--); }
+    basic_iterator &operator+=(ptrdiff_t n) { i_ += n; return *this; }
+    basic_iterator &operator-=(ptrdiff_t n) { i_ -= n; return *this; }
+    friend basic_iterator operator+(basic_iterator it, ptrdiff_t n) { return it += n; }
+    friend basic_iterator operator-(basic_iterator it, ptrdiff_t n) { return it -= n; }
+    friend ptrdiff_t operator-(const basic_iterator &a, const basic_iterator &b) { return a.i_ - b.i_; }
+    friend bool operator==(const basic_iterator &a, const basic_iterator &b) { return a.i_ == b.i_; }
+    friend bool operator!=(const basic_iterator &a, const basic_iterator &b) { return a.i_ != b.i_; }
+    friend bool operator<(const basic_iterator &a, const basic_iterator &b) { return a.i_ < b.i_; }
+    size_t index() const { return i_; }
+
+  private:
+    template<bool> friend class basic_iterator;
+    map_type *map_;
+    size_t i_;
+  };
+  typedef basic_iterator<false> iterator;
+  typedef basic_iterator<true> const_iterator;
+
+  shared_flat_map() { }
+
+  // Bulk construction from unsorted (key, value) input. The first of equal keys wins.
+  template<class It> shared_flat_map(It first, It last);
+  shared_flat_map(std::initializer_list<std::pair<K, V>> l) : shared_flat_map(l.begin(), l.end()) { }
+
+  iterator begin() { return iterator(this, 0); }
+  iterator end() { return iterator(this, size()); }
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, size()); }
+  size_t size() const { return keys_.size(); }
+  bool empty() const { return keys_.empty(); }
+  void clear() { keys_.clear(); values_.clear(); }
+  void reserve(size_t n) { keys_.reserve(n); values_.reserve(n); }
+  const shared_vector<K> &keys() const { return keys_; }
+  const shared_vector<V> &values() const { return values_; }
+
+  size_t lower_index(const K &k) const { return shared_flat_lower_bound(keys_.begin(), size(), k, C()) - keys_.begin(); }
+  size_t upper_index(const K &k) const
+  {
+    return shared_flat_lower_bound(keys_.begin(), size(), k, [](const K &a, const K &b) { return !C()(b, a); }) - keys_.begin();
+  }
+  size_t find_index(const K &k) const
+  {
+    size_t i = lower_index(k);
+    return i == size() || C()(k, keys_[i]) ? size() : i;
+  }
+
+  iterator lower_bound(const K &k) { return iterator(this, lower_index(k)); }
+  iterator upper_bound(const K &k) { return iterator(this, upper_index(k)); }
+  iterator find(const K &k) { return iterator(this, find_index(k)); }
+  const_iterator lower_bound(const K &k) const { return const_iterator(this, lower_index(k)); }
+  const_iterator upper_bound(const K &k) const { return const_iterator(this, upper_index(k)); }
+  const_iterator find(const K &k) const { return const_iterator(this, find_index(k)); }
+  bool contains(const K &k) const { return find_index(k) != size(); }
+  size_t count(const K &k) const { return contains(k); }
+
+  V &at(const K &k)
+  {
+    size_t i = find_index(k);
+    if(i == size()) throw std::out_of_range("shared_flat_map::at");
+    return values_[i];
+  }
+  const V &at(const K &k) const { return ((shared_flat_map *)this)->at(k); }
+
+  template<class... Args> std::pair<iterator, bool> try_emplace(const K &k, Args &&...args)
+  {
+    size_t i = lower_index(k);
+    if(i != size() && !C()(k, keys_[i])) return {iterator(this, i), false};
+    keys_.insert(keys_.begin() + i, k);
+    try {
+      values_.emplace(values_.begin() + i, std::forward<Args>(args)...);
+    } catch(...) {
+      keys_.erase(keys_.begin() + i);  // keep the two vectors parallel
+      throw;
+    }
+    return {iterator(this, i), true};
+  }
+  std::pair<iterator, bool> insert(const std::pair<K, V> &p) { return try_emplace(p.first, p.second); }
+  V &operator[](const K &k) { return try_emplace(k).first->second; }
+
+  size_t erase(const K &k)
+  {
+    size_t i = find_index(k);
+    if(i == size()) return 0;
+    erase(iterator(this, i));
+    return 1;
+  }
+  iterator erase(const_iterator it)
+  {
+    size_t i = it.index();
+    keys_.erase(keys_.begin() + i);
+    values_.erase(values_.begin() + i);
+    return iterator(this, i);
+  }
+
+private:
+  shared_vector<K> keys_;
+  shared_vector<V> values_;
+};
+
+template<class K, class V, class C>
+template<class It>
+shared_flat_map<K, V, C>::shared_flat_map(It first, It last)
+{
+  // Sort (key, value) pairs in local memory, then split them into the two vectors.
+  std::vector<std::pair<K, V>> tmp(first, last);
+  auto less = [](const std::pair<K, V> &a, const std::pair<K, V> &b) { return C()(a.first, b.first); };
+  shared_flat_sort(tmp.begin(), tmp.end(), less);
+  reserve(tmp.size());
+  for(std::pair<K, V> &p : tmp) {
+    if(!keys_.empty() && !C()(keys_.back(), p.first)) continue;
+    keys_.push_back(std::move(p.first));
+    values_.push_back(std::move(p.second));
+  }
+}
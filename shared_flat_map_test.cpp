@@ -0,0 +1,83 @@
+#include "shared_flat_map.h"
+#include <map>
+#include <set>
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <stdexcept>
+#include <iostream>
+
+using namespace std;
+
+int main()
+{
+  srand(time(NULL));
+  global_shared_allocator::shm_open(NULL, O_RDWR | O_CREAT | O_TRUNC);
+  atexit(global_shared_allocator::shm_close);
+  global_shared_allocator::shm_unlink();
+
+  // Bulk build from unsorted input with duplicates, large enough to sort in parallel.
+  vector<pair<int, int>> input;
+  map<int, int> v;
+  for(int i = 0; i < 300000; ++i) {
+    input.emplace_back(rand() % 100000, i);
+    v.emplace(input.back());
+  }
+  shared_flat_map<int, int> &m = *new(shared) shared_flat_map<int, int>(input.begin(), input.end());
+  assert(m.size() == v.size());
+  auto it = m.begin();
+  for(auto &[k, i] : v) {
+    assert(it->first == k && it->second == i);
+    ++it;
+  }
+  for(int i = 0; i < 100000; ++i) {
+    int k = rand() % 100100;
+    assert((v.lower_bound(k) == v.end()) == (m.lower_bound(k) == m.end()));
+    if(v.lower_bound(k) != v.end()) assert(v.lower_bound(k)->first == m.lower_bound(k)->first);
+    if(v.upper_bound(k) != v.end()) assert(v.upper_bound(k)->first == m.upper_bound(k)->first);
+    assert(m.contains(k) == v.count(k));
+  }
+
+  shared_vector<long> keys;
+  set<long> w;
+  for(int i = 0; i < 1000; ++i) w.insert(*keys.insert(keys.end(), rand() % 500));
+  shared_flat_set<long> &s = *new(shared) shared_flat_set<long>(keys);
+  assert(equal(s.begin(), s.end(), w.begin(), w.end()));
+
+  pid_t pid = fork();
+  if(pid < 0) {
+    err(EXIT_FAILURE, "fork");
+  } else if(pid == 0) {  // child
+    // Read and modify in another process.
+    for(auto &[k, i] : v) assert(m.at(k) == i);
+    m[-1] = -1;
+    assert(m.begin()->first == -1 && m.erase(100000) == 0 && m.erase(-1) == 1);
+    for(long i = 0; i < 600; ++i) s.insert(i);
+    _exit(0);
+  }
+  int status;
+  wait(&status);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  assert(m.size() == v.size() && !m.contains(-1));
+  assert(s.size() == 600 && *s.lower_bound(599) == 599 && s.upper_bound(599) == s.end());
+
+  // A throwing value constructor leaves keys and values parallel.
+  struct picky {
+    long x;
+    picky(long x) : x(x) { if(x < 0) throw runtime_error("negative"); }
+  };
+  shared_flat_map<long, picky> p;
+  p.try_emplace(1, 1);
+  p.try_emplace(3, 3);
+  try {
+    p.try_emplace(2, -2);
+    assert(false);
+  } catch(const runtime_error &) { }
+  assert(p.size() == 2 && !p.contains(2) && p.at(3).x == 3 && p.at(1).x == 1);
+  cout << "passed" << endl;
+  return 0;
+}
@@ -0,0 +1,274 @@
+/*
+ * Size-bounded object cache shared by processes.
+ *
+ * Keys are spread over independently locked shards, each evicting with the
+ * CLOCK approximation of LRU: a hit only sets a reference bit under a shared
+ * lock, so concurrent hits never serialize, and the hand gives referenced
+ * entries a second chance before evicting them.
+ *
+ * The budget is in bytes actually taken from the shared heap: the usable
+ * size of each entry plus what its key and value own (see shared_heap_bytes()).
+ * Index overhead is not counted.
+ *
+ * Written by <lyazj@github.com>.
+ */
+#pragma once
+#include "shared_flat_hash_map.h"
+#include "shared_sync.h"
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+// Shared heap bytes owned by a value besides the object itself. Overload it
+// for user types that own memory, e.g. by summing over their members.
+template<class T> size_t shared_heap_bytes(const T &) { return 0; }
+
+inline size_t shared_heap_bytes(const shared_string &s)
+{
+  // Short strings live inside the object.
+  size_t off = s.data() - (const char *)&s;
+  return off < sizeof s ? 0 : global_shared_allocator::usable_size(s.data());
+}
+
+template<class T> size_t shared_heap_bytes(const shared_vector<T> &v)
+{
+  size_t n = v.capacity() ? global_shared_allocator::usable_size(v.data()) : 0;
+  for(const T &e : v) n += shared_heap_bytes(e);
+  return n;
+}
+
+template<class K, class V, class H = std::hash<K>, class E = std::equal_to<K>>
+class shared_lru_cache {
+public:
+  typedef K key_type;
+  typedef V mapped_type;
+
+  // The budget is split evenly among shards, rounded up to a power of 2.
+  explicit shared_lru_cache(size_t budget, size_t shards = 16);
+  ~shared_lru_cache();
+  shared_lru_cache(const shared_lru_cache &) = delete;
+  shared_lru_cache &operator=(const shared_lru_cache &) = delete;
+
+  // Copies the value out and marks the entry referenced on a hit.
+  bool get(const K &k, V &v);
+  bool contains(const K &k) const;
+
+  // Inserts or replaces, then evicts down to the budget. Returns false without
+  // caching if the entry alone exceeds the budget of its shard.
+  bool put(const K &k, const V &v);
+  bool erase(const K &k);
+  void clear();
+
+  size_t size() const;
+  size_t bytes() const;
+  size_t budget() const { return shard_budget_ * (mask_ + 1); }
+
+private:
+  // A circular list per shard in insertion order.
+  struct node {
+    node *prev_, *next_;
+    std::atomic<uint8_t> ref_;
+    size_t bytes_;
+    K key_;
+    V value_;
+  };
+
+  // Shards are padded to whole cache lines, with at least one line after the fields written by
+  // put() so that they never share a line with the next shard's lock.
+  typedef shared_flat_hash_map<K, node *, H, E> index_type;
+  static inline constexpr size_t shard_data_ = sizeof(index_type) + sizeof(node *) + sizeof(size_t);
+  struct shard {
+    mutable shared_rwlock lock_;
+    char pad0_[shared_cache_line - sizeof(shared_rwlock)];
+    index_type index_;
+    node *hand_ = NULL;  // NULL if empty
+    size_t bytes_ = 0;
+    char pad1_[2 * shared_cache_line - shard_data_ % shared_cache_line];
+  };
+
+  shard *shards_;
+  size_t mask_, shard_budget_;
+
+  shard &shard_of(const K &k) const { return shards_[(size_t)(H()(k) * 0x9e3779b97f4a7c15ull) >> 32 & mask_]; }
+  static size_t cost(const node *n)
+  {
+    return global_shared_allocator::usable_size(n) + shared_heap_bytes(n->key_) + shared_heap_bytes(n->value_);
+  }
+
+  // The shard lock is held exclusively.
+  void evict(shard &s, const node *keep);
+  static void unlink(shard &s, node *n);
+  static void destroy(node *n);
+};
+
+template<class K, class V, class H, class E>
+shared_lru_cache<K, V, H, E>::shared_lru_cache(size_t budget, size_t shards)
+{
+  size_t n = 1;
+  while(n < shards) n <<= 1;
+  mask_ = n - 1;
+  shard_budget_ = budget / n;
+  shards_ = shared_allocator<shard>().allocate(n);
+  for(size_t i = 0; i < n; ++i) new(&shards_[i]) shard;
+}
+
+template<class K, class V, class H, class E>
+shared_lru_cache<K, V, H, E>::~shared_lru_cache()
+{
+  clear();
+  for(size_t i = 0; i <= mask_; ++i) shards_[i].~shard();
+  shared_allocator<shard>().deallocate(shards_, mask_ + 1);
+}
+
+template<class K, class V, class H, class E>
+bool shared_lru_cache<K, V, H, E>::get(const K &k, V &v)
+{
+  shard &s = shard_of(k);
+  std::shared_lock<shared_rwlock> l(s.lock_);
+  auto it = s.index_.find(k);
+  if(it == s.index_.end()) return false;
+  node *n = it->second;
+  if(!n->ref_.load(std::memory_order_relaxed)) n->ref_.store(1, std::memory_order_relaxed);  // keep the line clean
+  v = n->value_;
+  return true;
+}
+
+template<class K, class V, class H, class E>
+bool shared_lru_cache<K, V, H, E>::contains(const K &k) const
+{
+  shard &s = shard_of(k);
+  std::shared_lock<shared_rwlock> l(s.lock_);
+  return s.index_.contains(k);
+}
+
+template<class K, class V, class H, class E>
+bool shared_lru_cache<K, V, H, E>::put(const K &k, const V &v)
+{
+  shard &s = shard_of(k);
+  std::lock_guard<shared_rwlock> l(s.lock_);
+  auto it = s.index_.find(k);
+  node *n;
+  if(it != s.index_.end()) {
+    n = it->second;
+    n->value_ = v;
+    s.bytes_ -= n->bytes_;
+    n->ref_.store(1, std::memory_order_relaxed);
+  } else {
+    // Indexed before linked: a failure leaves nothing behind.
+    n = new(shared) node{NULL, NULL, {0}, 0, k, v};
+    try {
+      s.index_.try_emplace(k, n);
+    } catch(...) {
+      destroy(n);
+      throw;
+    }
+    if(s.hand_) {
+      n->next_ = s.hand_;
+      n->prev_ = s.hand_->prev_;
+      n->prev_->next_ = n;
+      s.hand_->prev_ = n;
+    } else {
+      n->prev_ = n->next_ = s.hand_ = n;
+    }
+  }
+  n->bytes_ = cost(n);
+  s.bytes_ += n->bytes_;
+  if(n->bytes_ > shard_budget_) {
+    s.index_.erase(k);
+    unlink(s, n);
+    destroy(n);
+    return false;
+  }
+  evict(s, n);
+  return true;
+}
+
+template<class K, class V, class H, class E>
+bool shared_lru_cache<K, V, H, E>::erase(const K &k)
+{
+  shard &s = shard_of(k);
+  std::lock_guard<shared_rwlock> l(s.lock_);
+  auto it = s.index_.find(k);
+  if(it == s.index_.end()) return false;
+  node *n = it->second;
+  s.index_.erase(it);
+  unlink(s, n);
+  destroy(n);
+  return true;
+}
+
+template<class K, class V, class H, class E>
+void shared_lru_cache<K, V, H, E>::clear()
+{
+  for(size_t i = 0; i <= mask_; ++i) {
+    shard &s = shards_[i];
+    std::lock_guard<shared_rwlock> l(s.lock_);
+    for(auto &p : s.index_) destroy(p.second);
+    s.index_.clear();
+    s.hand_ = NULL;
+    s.bytes_ = 0;
+  }
+}
+
+template<class K, class V, class H, class E>
+size_t shared_lru_cache<K, V, H, E>::size() const
+{
+  size_t n = 0;
+  for(size_t i = 0; i <= mask_; ++i) {
+    std::shared_lock<shared_rwlock> l(shards_[i].lock_);
+    n += shards_[i].index_.size();
+  }
+  return n;
+}
+
+template<class K, class V, class H, class E>
+size_t shared_lru_cache<K, V, H, E>::bytes() const
+{
+  size_t n = 0;
+  for(size_t i = 0; i <= mask_; ++i) {
+    std::shared_lock<shared_rwlock> l(shards_[i].lock_);
+    n += shards_[i].bytes_;
+  }
+  return n;
+}
+
+template<class K, class V, class H, class E>
+void shared_lru_cache<K, V, H, E>::evict(shard &s, const node *keep)
+{
+  // keep fits in the budget alone, so this ends before reaching it twice in a row.
+  while(s.bytes_ > shard_budget_) {
+    node *n = s.hand_;
+    s.hand_ = n->next_;
+    if(n == keep) continue;
+    if(n->ref_.load(std::memory_order_relaxed)) {
+      n->ref_.store(0, std::memory_order_relaxed);
+      continue;
+    }
+    s.index_.erase(n->key_);
+    unlink(s, n);
+    destroy(n);
+  }
+}
+
+template<class K, class V, class H, class E>
+void shared_lru_cache<K, V, H, E>::unlink(shard &s, node *n)
+{
+  s.bytes_ -= n->bytes_;
+  if(n->next_ == n) {
+    s.hand_ = NULL;
+    return;
+  }
+  if(s.hand_ == n) s.hand_ = n->next_;
+  n->prev_->next_ = n->next_;
+  n->next_->prev_ = n->prev_;
+}
+
+template<class K, class V, class H, class E>
+void shared_lru_cache<K, V, H, E>::destroy(node *n)
+{
+  n->~node();
+  operator delete(n, shared);
+}
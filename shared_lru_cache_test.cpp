@@ -0,0 +1,66 @@
+#include "shared_lru_cache.h"
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <iostream>
+
+using namespace std;
+
+static constexpr size_t budget = 1 << 20;
+static constexpr int n_proc = 4, n_op = 20000;
+static shared_lru_cache<long, shared_string> *cache;
+
+static shared_string value_of(long k) { return shared_string(k % 500 + 1, 'a' + k % 26); }
+
+int main()
+{
+  global_shared_allocator::shm_open(NULL, O_RDWR | O_CREAT | O_TRUNC);
+  atexit(global_shared_allocator::shm_close);
+  global_shared_allocator::shm_unlink();
+
+  // Referenced entries survive a sweep; cold ones go first.
+  {
+    shared_lru_cache<int, long> c(16 * 1024, 1);
+    int n = 0;
+    while(c.bytes() + 64 <= c.budget()) c.put(n++, 0);
+    long v;
+    for(int k = 0; k < n; k += 2) assert(c.get(k, v));
+    for(int k = n; k < n + n / 4; ++k) assert(c.put(k, 0));
+    for(int k = 0; k < n; k += 2) assert(c.contains(k));
+    assert(!c.contains(1) && c.bytes() <= c.budget());
+    assert(c.erase(0) && !c.erase(0) && !c.contains(0));
+    assert(!c.put(-1, 0) || c.contains(-1));
+  }
+
+  // An entry larger than its shard is not cached.
+  {
+    shared_lru_cache<int, shared_string> c(1024, 1);
+    assert(!c.put(1, shared_string(4096, 'x')) && c.size() == 0 && c.bytes() == 0);
+  }
+
+  // Concurrent puts and gets stay within the budget and never return wrong values.
+  cache = new(shared) shared_lru_cache<long, shared_string>(budget);
+  for(int p = 0; p < n_proc; ++p) {
+    pid_t pid = fork();
+    if(pid < 0) err(EXIT_FAILURE, "fork");
+    if(pid) continue;
+    srand(p);
+    shared_string v;
+    for(int i = 0; i < n_op; ++i) {
+      long k = rand() % 20000;
+      if(cache->get(k, v)) assert(v == value_of(k));
+      else cache->put(k, value_of(k));
+      if(i % 1000 == 0) assert(cache->bytes() <= cache->budget());
+    }
+    _exit(0);
+  }
+  int status;
+  while(wait(&status) > 0) assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  assert(cache->bytes() <= budget && cache->bytes() > budget / 2 && cache->size() > 0);
+  cache->~shared_lru_cache();
+  operator delete(cache, shared);
+  cout << "passed" << endl;
+  return 0;
+}
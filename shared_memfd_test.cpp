@@ -0,0 +1,105 @@
+#include "shared_allocator.h"
+#include "shared_container.h"
+#include "shared_notify.h"
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+typedef shared_map<int, shared_string> map_t;
+static constexpr int n_item = 10000;
+
+static shared_string value(int i)
+{
+  return shared_string("value of a long enough key ") + to_string(i).c_str();
+}
+
+// Another program: attach from the descriptor received on `sock`, check and add.
+static int attach(int sock, void *addr)
+{
+  global_shared_allocator::fd_open(recv_fd(sock));
+  assert(global_shared_allocator::shm_addr() == addr);
+  map_t *m = (map_t *)global_shared_allocator::root();
+  assert((int)m->size() == n_item);
+  for(int i = 0; i < n_item; ++i) assert(m->at(i) == value(i));
+  for(int i = n_item; i < 2 * n_item; ++i) m->emplace(i, value(i));
+  global_shared_allocator::shm_close();
+  return 0;
+}
+
+static size_t free_huge_pages()
+{
+  ifstream in("/proc/meminfo");
+  string key;
+  size_t n;
+  while(in >> key >> n) {
+    if(key == "HugePages_Free:") return n;
+    in.ignore(256, '\n');
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc == 3) return attach(atoi(argv[1]), (void *)strtoull(argv[2], NULL, 16));
+
+  global_shared_allocator::memfd_open("shared_memfd_test");
+  assert(strcmp(global_shared_allocator::shm_name(), "shared_memfd_test") == 0);
+  assert(access("/dev/shm/shared_memfd_test", F_OK) < 0);
+  global_shared_allocator::shm_unlink();  // nothing to remove
+  void *addr = global_shared_allocator::shm_addr();
+  map_t *m = new(shared) map_t;
+  for(int i = 0; i < n_item; ++i) m->emplace(i, value(i));
+  global_shared_allocator::set_root(m);
+
+  // The heap has grown, and every page of the file is allocated, none left to fault in.
+  struct stat st;
+  assert(fstat(global_shared_allocator::shm_fd(), &st) == 0);
+  assert(st.st_size > 4096 && (size_t)st.st_blocks * 512 >= (size_t)st.st_size);
+
+  // Hand the segment to an unrelated program over a Unix socket.
+  int sv[2];
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) err(EXIT_FAILURE, "socketpair");
+  pid_t pid = fork();
+  if(pid < 0) err(EXIT_FAILURE, "fork");
+  if(pid == 0) {
+    char sock[16], a[32];
+    snprintf(sock, sizeof sock, "%d", sv[1]);
+    snprintf(a, sizeof a, "%p", addr);
+    execl(argv[0], argv[0], sock, a, (char *)NULL);
+    _exit(127);
+  }
+  send_fd(sv[0], global_shared_allocator::shm_fd());
+  int status;
+  assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  assert((int)m->size() == 2 * n_item);
+  for(int i = 0; i < 2 * n_item; ++i) assert(m->at(i) == value(i));
+  m->~map_t();
+  operator delete(m, shared);
+  global_shared_allocator::shm_close();
+  close(sv[0]);
+  close(sv[1]);
+
+  // Huge pages, where some are reserved: the segment grows in whole huge pages.
+  if(free_huge_pages() >= 8) {
+    global_shared_allocator::memfd_open("shared_memfd_test.huge", MFD_HUGETLB);
+    assert(fstat(global_shared_allocator::shm_fd(), &st) == 0);
+    size_t huge = st.st_blksize;
+    assert(huge > 4096 && st.st_size % huge == 0);
+    shared_vector<char> v(huge * 2, 'x');
+    assert(fstat(global_shared_allocator::shm_fd(), &st) == 0 && st.st_size % huge == 0);
+    assert(v[huge] == 'x');
+    v = shared_vector<char>();
+    global_shared_allocator::shm_close();
+  }
+  cout << "passed" << endl;
+  return 0;
+}
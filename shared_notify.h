@@ -0,0 +1,210 @@
+/*
+ * Readiness notification of shared containers through file descriptors.
+ *
+ * Futexes cannot be polled, so a consumer that multiplexes shared queues
+ * with sockets parks on an eventfd instead. The eventfd is handed to
+ * producers over a Unix socket, and producers write it only while the
+ * consumer is parked:
+ *   consumer: int fd = n->create(); send_fd(sock, fd);  // once
+ *             n->park(); if(q->empty()) epoll_wait(...); n->unpark();
+ *   producer: int fd = recv_fd(sock);                  // once
+ *             q->push(v); n->notify(fd);
+ * With C++20 coroutines, `co_await shared_ready(*n, reactor, pred)` does the
+ * parking inside an epoll-based shared_reactor.
+ *
+ * Written by <lyazj@github.com>.
+ */
+#pragma once
+#include "shared_sync.h"
+#include <system_error>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// Pass a descriptor to the peer of a Unix domain socket.
+inline void send_fd(int sock, int fd)
+{
+  char byte = 0;
+  iovec iov = {&byte, 1};
+  alignas(cmsghdr) char buf[CMSG_SPACE(sizeof(int))] = {};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = buf;
+  msg.msg_controllen = sizeof buf;
+  cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(c), &fd, sizeof(int));
+  while(sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+    if(errno != EINTR) throw std::system_error(errno, std::system_category(), "sendmsg");
+  }
+}
+
+// Receive a descriptor sent by send_fd(). It is opened with FD_CLOEXEC.
+inline int recv_fd(int sock)
+{
+  char byte;
+  iovec iov = {&byte, 1};
+  alignas(cmsghdr) char buf[CMSG_SPACE(sizeof(int))];
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = buf;
+  msg.msg_controllen = sizeof buf;
+  ssize_t r;
+  while((r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0) {
+    if(errno != EINTR) throw std::system_error(errno, std::system_category(), "recvmsg");
+  }
+  // Close whatever we got unless it is exactly one descriptor.
+  cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  size_t n = 0;
+  if(c && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  bool ok = r > 0 && n == 1 && !(msg.msg_flags & MSG_CTRUNC);
+  int fd = -1;
+  for(size_t i = 0; i < n; ++i) {
+    memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+    if(!ok) close(fd);
+  }
+  if(!ok) throw std::system_error(EBADMSG, std::system_category(), "recv_fd");
+  return fd;
+}
+
+// Lives in the shared memory, one per consumer.
+class shared_notifier {
+public:
+  shared_notifier() : parked_(0), fd_(-1) { }
+  shared_notifier(const shared_notifier &) = delete;
+  shared_notifier &operator=(const shared_notifier &) = delete;
+
+  // Consumer side. The descriptor is the consumer's; producers get their own with recv_fd().
+  int create()
+  {
+    fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(fd_ < 0) throw std::system_error(errno, std::system_category(), "eventfd");
+    return fd_;
+  }
+  int fd() const { return fd_; }
+
+  // Check the condition after park() and before sleeping on fd(). A notification
+  // made after park() is not missed.
+  void park() { parked_.store(1); }
+  void unpark()
+  {
+    parked_.store(0, std::memory_order_relaxed);
+    uint64_t n;
+    while(read(fd_, &n, sizeof n) < 0 && errno == EINTR) { }
+  }
+
+  // Producer side, after making the condition true. A system call is made
+  // only when the consumer is parked.
+  void notify(int fd)
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(!parked_.load(std::memory_order_relaxed) || !parked_.exchange(0)) return;
+    uint64_t one = 1;
+    while(write(fd, &one, sizeof one) < 0 && errno == EINTR) { }
+  }
+
+private:
+  std::atomic<uint32_t> parked_;
+  int fd_;  // valid in the consumer process only
+};
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#include <sys/epoll.h>
+
+// A minimal epoll loop resuming coroutines that wait for descriptors.
+// Its own descriptor can be nested in another loop.
+class shared_reactor {
+public:
+  // Called back by poll(), usually to resume a coroutine.
+  struct waiter {
+    void (*ready_)(waiter *);
+  };
+
+  shared_reactor()
+  {
+    epfd_ = epoll_create1(EPOLL_CLOEXEC);
+    if(epfd_ < 0) throw std::system_error(errno, std::system_category(), "epoll_create1");
+  }
+  ~shared_reactor() { close(epfd_); }
+  shared_reactor(const shared_reactor &) = delete;
+  shared_reactor &operator=(const shared_reactor &) = delete;
+  int fd() const { return epfd_; }
+
+  // Call w back once when fd becomes readable.
+  void watch(int fd, waiter *w)
+  {
+    epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = w;
+    if(epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev) && (errno != ENOENT || epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev))) {
+      throw std::system_error(errno, std::system_category(), "epoll_ctl");
+    }
+  }
+
+  // Wait up to timeout milliseconds (-1: forever) and call back what is ready. Returns how many.
+  int poll(int timeout = -1)
+  {
+    epoll_event evs[64];
+    int n = epoll_wait(epfd_, evs, 64, timeout);
+    if(n < 0 && errno != EINTR) throw std::system_error(errno, std::system_category(), "epoll_wait");
+    for(int i = 0; i < n; ++i) {
+      waiter *w = (waiter *)evs[i].data.ptr;
+      w->ready_(w);
+    }
+    return n < 0 ? 0 : n;
+  }
+
+private:
+  int epfd_;
+};
+
+// co_await until ready() returns true, e.g. [q] { return !q->empty(); }.
+// A wake-up with ready() false again (a stale or consumed notification)
+// parks again instead of resuming.
+template<class F>
+class shared_ready : shared_reactor::waiter {
+public:
+  shared_ready(shared_notifier &n, shared_reactor &r, F ready)
+    : shared_reactor::waiter{wake}, n_(n), r_(r), ready_(std::move(ready)) { }
+  bool await_ready() { return ready_(); }
+  bool await_suspend(std::coroutine_handle<> h)
+  {
+    h_ = h;
+    return sleep();
+  }
+  void await_resume() { }
+
+private:
+  shared_notifier &n_;
+  shared_reactor &r_;
+  F ready_;
+  std::coroutine_handle<> h_;
+
+  // Park, then watch the eventfd unless ready() already holds.
+  bool sleep()
+  {
+    n_.park();
+    if(ready_()) {
+      n_.unpark();
+      return false;
+    }
+    r_.watch(n_.fd(), this);
+    return true;
+  }
+  static void wake(shared_reactor::waiter *w)
+  {
+    shared_ready *self = static_cast<shared_ready *>(w);
+    self->n_.unpark();
+    if(!self->sleep()) self->h_.resume();
+  }
+};
+#endif
@@ -0,0 +1,179 @@
+#include "shared_notify.h"
+#include "shared_queue.h"
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <iostream>
+
+using namespace std;
+
+static constexpr long n_item = 20000;
+static shared_mpmc_queue<long> *queue;
+static shared_notifier *notifier;
+
+// Producer: get the consumer's eventfd, then push in bursts with pauses so the consumer parks.
+static void produce(int sock)
+{
+  int fd = recv_fd(sock);
+  for(long i = 0; i < n_item; ++i) {
+    queue->push(i);
+    notifier->notify(fd);
+    if(i % 1000 == 999) usleep(1000);
+  }
+  close(fd);
+}
+
+static pid_t spawn(int sock)
+{
+  pid_t pid = fork();
+  if(pid < 0) err(EXIT_FAILURE, "fork");
+  if(pid == 0) { produce(sock); _exit(0); }
+  return pid;
+}
+
+static void wait_child(pid_t pid)
+{
+  int status;
+  assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+// A fire-and-forget coroutine driven by the reactor.
+struct detached {
+  struct promise_type {
+    detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() { }
+    void unhandled_exception() { abort(); }
+  };
+};
+
+static detached consume(shared_reactor &r, long &next, bool &done)
+{
+  long v;
+  while(next < n_item) {
+    co_await shared_ready(*notifier, r, [] { return !queue->empty(); });
+    while(queue->try_pop(v)) assert(v == next++);
+  }
+  done = true;
+}
+
+static detached wait_one(shared_reactor &r, bool &done)
+{
+  co_await shared_ready(*notifier, r, [] { return !queue->empty(); });
+  done = true;
+}
+#endif
+
+int main()
+{
+  global_shared_allocator::shm_open(NULL, O_RDWR | O_CREAT | O_TRUNC);
+  atexit(global_shared_allocator::shm_close);
+  global_shared_allocator::shm_unlink();
+
+  queue = new(shared) shared_mpmc_queue<long>(n_item);
+  notifier = new(shared) shared_notifier;
+  int efd = notifier->create();
+
+  // A descriptor survives the trip through the socket.
+  int sv[2];
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) err(EXIT_FAILURE, "socketpair");
+  send_fd(sv[0], efd);
+  int dup = recv_fd(sv[1]);
+  assert(dup != efd);
+  notifier->park();
+  notifier->notify(dup);
+  pollfd pfd = {efd, POLLIN, 0};
+  assert(poll(&pfd, 1, 0) == 1);
+  notifier->unpark();
+  assert(poll(&pfd, 1, 0) == 0);
+
+  // Producers do not signal while the consumer is running.
+  notifier->notify(dup);
+  assert(poll(&pfd, 1, 0) == 0);
+  close(dup);
+
+  // Messages without exactly one descriptor are rejected without leaking any.
+  int probe = ::dup(0);
+  close(probe);
+  char byte = 0;
+  assert(write(sv[0], &byte, 1) == 1);
+  try { recv_fd(sv[1]); assert(false); } catch(const system_error &e) { assert(e.code().value() == EBADMSG); }
+  for(int n = 2; n <= 3; ++n) {  // fits in the buffer, truncated
+    int fds[3] = {efd, efd, efd};
+    iovec iov = {&byte, 1};
+    alignas(cmsghdr) char buf[CMSG_SPACE(sizeof fds)];
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+    cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(n * sizeof(int));
+    memcpy(CMSG_DATA(c), fds, n * sizeof(int));
+    assert(sendmsg(sv[0], &msg, 0) == 1);
+    try { recv_fd(sv[1]); assert(false); } catch(const system_error &e) { assert(e.code().value() == EBADMSG); }
+  }
+  int again = ::dup(0);
+  assert(again == probe);
+  close(again);
+
+  // An epoll-style loop: poll the eventfd next to a socket that never becomes readable.
+  pid_t pid = spawn(sv[1]);
+  send_fd(sv[0], efd);
+  long next = 0, v, n_park = 0;
+  while(next < n_item) {
+    notifier->park();
+    if(queue->empty()) {
+      pollfd fds[2] = {{efd, POLLIN, 0}, {sv[0], POLLIN, 0}};
+      assert(poll(fds, 2, -1) == 1 && fds[0].revents == POLLIN);
+      ++n_park;
+    }
+    notifier->unpark();
+    while(queue->try_pop(v)) assert(v == next++);
+  }
+  wait_child(pid);
+  assert(n_park > 0 && n_park < n_item);
+  assert(queue->empty());
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+  // The same through the coroutine awaitable.
+  pid = spawn(sv[1]);
+  send_fd(sv[0], efd);
+  shared_reactor reactor;
+  next = 0;
+  bool done = false;
+  consume(reactor, next, done);
+  while(!done) reactor.poll();
+  wait_child(pid);
+  assert(next == n_item && queue->empty());
+
+  // A stale count on the eventfd does not resume the coroutine while the queue is empty.
+  uint64_t one = 1;
+  assert(write(efd, &one, sizeof one) == sizeof one);
+  done = false;
+  wait_one(reactor, done);
+  assert(reactor.poll(0) == 1 && !done);
+  queue->push(0);
+  notifier->notify(efd);
+  assert(reactor.poll(0) == 1 && done);
+  assert(queue->try_pop(v) && v == 0);
+#endif
+
+  close(sv[0]);
+  close(sv[1]);
+  close(efd);
+  notifier->~shared_notifier();
+  operator delete(notifier, shared);
+  queue->~shared_mpmc_queue();
+  operator delete(queue, shared);
+  cout << "passed" << endl;
+  return 0;
+}
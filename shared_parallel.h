@@ -0,0 +1,138 @@
+/*
+ * Parallel algorithms over ranges in the shared memory.
+ *
+ * Ranges are split into chunks processed by the workers of a
+ * shared_process_pool, and results are merged in place, so all cores work
+ * on the same shared data with process isolation instead of threads:
+ *   shared_parallel_sort(*pool, v->begin(), v->end());
+ *   long sum = shared_parallel_reduce(*pool, v->begin(), v->end(), 0L, std::plus<long>());
+ *
+ * Iterators must point into the shared memory. Functors are copied to the
+ * workers like any task. The calls wait for the whole pool, so do not mix
+ * them with other outstanding tasks nor call them from the pool's workers.
+ *
+ * Written by <lyazj@github.com>.
+ */
+#pragma once
+#include "shared_process_pool.h"
+#include <algorithm>
+#include <iterator>
+#include <functional>
+#include <vector>
+#include <stddef.h>
+
+// Chunk boundaries: a few chunks per worker for balance, none too small.
+template<class It>
+std::vector<It> shared_parallel_split(const shared_process_pool &pool, It first, It last, size_t min_chunk = 4096)
+{
+  size_t n = last - first;
+  size_t n_chunk = std::max<size_t>(1, std::min(4 * pool.size(), n / min_chunk));
+  std::vector<It> bound;
+  for(size_t i = 0; i <= n_chunk; ++i) bound.push_back(first + n * i / n_chunk);
+  return bound;
+}
+
+template<class It, class F>
+void shared_parallel_for_each(shared_process_pool &pool, It first, It last, F f)
+{
+  std::vector<It> bound = shared_parallel_split(pool, first, last);
+  for(size_t i = 0; i + 1 < bound.size(); ++i) {
+    pool.submit([a = bound[i], b = bound[i + 1], f] { std::for_each(a, b, f); });
+  }
+  pool.wait();
+}
+
+template<class It, class Out, class F>
+Out shared_parallel_transform(shared_process_pool &pool, It first, It last, Out out, F f)
+{
+  std::vector<It> bound = shared_parallel_split(pool, first, last);
+  for(size_t i = 0; i + 1 < bound.size(); ++i) {
+    pool.submit([a = bound[i], b = bound[i + 1], o = out + (bound[i] - first), f] { std::transform(a, b, o, f); });
+  }
+  pool.wait();
+  return out + (last - first);
+}
+
+// op must be associative. Chunk results are combined in order, so it need not be commutative.
+// They pass through the shared memory, so T must be storable there, e.g. trivially copyable.
+template<class It, class T, class Op>
+T shared_parallel_reduce(shared_process_pool &pool, It first, It last, T init, Op op)
+{
+  std::vector<It> bound = shared_parallel_split(pool, first, last);
+  size_t n_chunk = bound.size() - 1;
+  shared_vector<T> partial(n_chunk, init);
+  T *p = partial.data();
+  for(size_t i = 0; i < n_chunk; ++i) {
+    pool.submit([a = bound[i], b = bound[i + 1], r = p + i, op] {
+      if(a == b) return;
+      T acc = *a;
+      for(It it = std::next(a); it != b; ++it) acc = op(std::move(acc), *it);
+      *r = std::move(acc);
+    });
+  }
+  pool.wait();
+  T acc = std::move(init);
+  for(size_t i = 0; i < n_chunk; ++i) {
+    if(bound[i] != bound[i + 1]) acc = op(std::move(acc), std::move(p[i]));
+  }
+  return acc;
+}
+
+// Chunks are sorted in parallel, then neighbours are merged pairwise in rounds.
+template<class It, class C = std::less<>>
+void shared_parallel_sort(shared_process_pool &pool, It first, It last, C comp = C())
+{
+  std::vector<It> bound = shared_parallel_split(pool, first, last);
+  for(size_t i = 0; i + 1 < bound.size(); ++i) {
+    pool.submit([a = bound[i], b = bound[i + 1], comp] { std::sort(a, b, comp); });
+  }
+  pool.wait();
+  while(bound.size() > 2) {
+    std::vector<It> next;
+    size_t i = 0;
+    for(; i + 2 < bound.size(); i += 2) {
+      pool.submit([a = bound[i], b = bound[i + 1], c = bound[i + 2], comp] { std::inplace_merge(a, b, c, comp); });
+      next.push_back(bound[i]);
+    }
+    next.insert(next.end(), bound.begin() + i, bound.end());  // an odd chunk, then `last`
+    pool.wait();
+    bound.swap(next);
+  }
+}
+
+// Not stable. Returns the first element for which pred is false.
+template<class It, class P>
+It shared_parallel_partition(shared_process_pool &pool, It first, It last, P pred)
+{
+  // Partition chunks in parallel: chunk i becomes [bound[i], mid[i]) true, [mid[i], bound[i + 1]) false.
+  std::vector<It> bound = shared_parallel_split(pool, first, last);
+  size_t n_chunk = bound.size() - 1;
+  shared_vector<size_t> n_true(n_chunk);
+  size_t *t = n_true.data();
+  for(size_t i = 0; i < n_chunk; ++i) {
+    pool.submit([a = bound[i], b = bound[i + 1], r = t + i, pred] { *r = std::partition(a, b, pred) - a; });
+  }
+  pool.wait();
+  std::vector<It> mid;
+  for(size_t i = 0; i < n_chunk; ++i) mid.push_back(bound[i] + t[i]);
+
+  // Join neighbours pairwise in rounds by rotating the false part of the left past the true part of the right.
+  while(bound.size() > 2) {
+    std::vector<It> next_bound, next_mid;
+    size_t i = 0;
+    for(; i + 2 < bound.size(); i += 2) {
+      pool.submit([m = mid[i], b = bound[i + 1], n = mid[i + 1]] { std::rotate(m, b, n); });
+      next_bound.push_back(bound[i]);
+      next_mid.push_back(mid[i] + (mid[i + 1] - bound[i + 1]));
+    }
+    if(i + 1 < bound.size()) {  // an odd chunk
+      next_bound.push_back(bound[i]);
+      next_mid.push_back(mid[i]);
+    }
+    next_bound.push_back(bound.back());
+    pool.wait();
+    bound.swap(next_bound);
+    mid.swap(next_mid);
+  }
+  return mid[0];
+}
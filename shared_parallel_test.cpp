@@ -0,0 +1,55 @@
+#include "shared_parallel.h"
+#include <numeric>
+#include <assert.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <iostream>
+
+using namespace std;
+
+int main()
+{
+  global_shared_allocator::shm_open(NULL, O_RDWR | O_CREAT | O_TRUNC);
+  atexit(global_shared_allocator::shm_close);
+  global_shared_allocator::shm_unlink();
+  auto *pool = new(shared) shared_process_pool(4);
+
+  constexpr size_t n = 1 << 20;
+  auto *v = new(shared) shared_vector<long>(n);
+  srand(1);
+  for(long &x : *v) x = rand() % 100000;
+  vector<long> ref(v->begin(), v->end());
+
+  // for_each and transform.
+  shared_parallel_for_each(*pool, v->begin(), v->end(), [](long &x) { x *= 2; });
+  for(size_t i = 0; i < n; ++i) assert((*v)[i] == ref[i] * 2);
+  auto *w = new(shared) shared_vector<long>(n);
+  assert(shared_parallel_transform(*pool, v->begin(), v->end(), w->begin(), [](long x) { return x / 2; }) == w->end());
+  assert(equal(w->begin(), w->end(), ref.begin()));
+
+  // reduce, including a non-commutative operation.
+  assert(shared_parallel_reduce(*pool, w->begin(), w->end(), 0L, plus<long>()) == accumulate(ref.begin(), ref.end(), 0L));
+  auto first = [](long a, long) { return a; };
+  assert(shared_parallel_reduce(*pool, w->begin() + 1, w->end(), ref[0], first) == ref[0]);
+  assert(shared_parallel_reduce(*pool, w->begin(), w->begin(), 7L, plus<long>()) == 7);
+
+  // sort.
+  shared_parallel_sort(*pool, w->begin(), w->end());
+  sort(ref.begin(), ref.end());
+  assert(equal(w->begin(), w->end(), ref.begin()));
+  shared_parallel_sort(*pool, w->begin(), w->end(), greater<long>());
+  assert(is_sorted(w->begin(), w->end(), greater<long>()));
+
+  // partition.
+  shared_parallel_for_each(*pool, v->begin(), v->end(), [](long &x) { x /= 2; });
+  auto odd = [](long x) { return x % 2 != 0; };
+  auto mid = shared_parallel_partition(*pool, v->begin(), v->end(), odd);
+  assert(all_of(v->begin(), mid, odd) && none_of(mid, v->end(), odd));
+  assert(mid - v->begin() == count_if(ref.begin(), ref.end(), odd));
+  assert(shared_parallel_partition(*pool, v->begin(), v->begin(), odd) == v->begin());
+
+  pool->~shared_process_pool();
+  operator delete(pool, shared);
+  cout << "passed" << endl;
+  return 0;
+}
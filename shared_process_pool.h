@@ -0,0 +1,262 @@
+/*
+ * Pool of forked worker processes running tasks from the shared memory.
+ *
+ * Workers are forked when the pool is constructed and stay attached to the
+ * segment. Each has a Chase-Lev work-stealing deque: tasks submitted by a
+ * worker go to its own deque, those from other processes to a shared
+ * injection queue, and idle workers steal before sleeping on a futex. A
+ * worker whose deque and the injection queue are both full runs the task
+ * itself rather than block:
+ *   auto *pool = new(shared) shared_process_pool(8);
+ *   for(size_t i = 0; i < n; ++i) pool->submit([v, i] { work((*v)[i]); });
+ *   pool->wait();
+ *
+ * Tasks are copied into the shared memory and run in another process, so
+ * they must refer to shared memory or to data that existed at the fork.
+ * Only the creating process destroys the pool. A worker that crashes takes
+ * its queued tasks with it, so wait() would not return.
+ *
+ * Written by <lyazj@github.com>.
+ */
+#pragma once
+#include "shared_queue.h"
+#include "shared_container.h"
+#include <thread>
+#include <string>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <system_error>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+class shared_process_pool {
+public:
+  // 0 means one worker per CPU.
+  explicit shared_process_pool(size_t n_worker = 0);
+  ~shared_process_pool();
+  shared_process_pool(const shared_process_pool &) = delete;
+  shared_process_pool &operator=(const shared_process_pool &) = delete;
+
+  // Copy f into the shared memory and run it in some worker.
+  template<class F> void submit(F f);
+
+  // Block until every submitted task, including those submitted by tasks,
+  // has finished. Throws if any of them threw since the last wait().
+  void wait();
+
+  size_t size() const { return n_worker_; }
+
+  // The index of the calling worker, or -1 outside the pool's workers.
+  static int worker_index() { return self_; }
+
+  // The pool of the calling worker, e.g. for tasks to submit more tasks,
+  // as the creator's pointer to the pool may not exist yet at the fork.
+  static shared_process_pool *current() { return current_; }
+
+private:
+  // Code addresses are the same in forked workers, so a task records how to run itself.
+  struct task {
+    void (*run_)(task *, bool);  // run (or just discard) and free
+  };
+  template<class F> struct task_of : task {
+    F f_;
+  };
+
+  // Chase-Lev deque of bounded capacity. Only the owning worker pushes and pops.
+  struct deque {
+    std::atomic<int64_t> top_;
+    char pad0_[shared_cache_line - sizeof(std::atomic<int64_t>)];
+    std::atomic<int64_t> bottom_;
+    char pad1_[shared_cache_line - sizeof(std::atomic<int64_t>)];
+    std::atomic<task *> slots_[1024];
+
+    static inline constexpr int64_t mask_ = 1023;
+    deque() : top_(0), bottom_(0) { }
+    bool push(task *t);
+    task *pop();
+    task *steal();
+    bool empty() const { return bottom_.load() <= top_.load(); }
+  };
+
+  size_t n_worker_;
+  deque *deques_;
+  shared_vector<pid_t> pids_;
+  shared_mpmc_queue<task *> inject_;
+  std::atomic<size_t> pending_, failed_;
+  std::atomic<uint32_t> stop_;
+  shared_event_count work_, done_;
+
+  // Process-local.
+  static inline int self_ = -1;
+  static inline shared_process_pool *current_;
+
+  void push(task *t);
+  task *take();
+  bool has_work() const;
+  void work();
+  void finish(task *t);
+};
+
+template<class F>
+void shared_process_pool::submit(F f)
+{
+  typedef task_of<F> T;
+  T *t = (T *)global_shared_allocator::allocate(sizeof(T));
+  new(&t->f_) F(std::move(f));
+  t->run_ = [](task *p, bool run) {
+    T *t = (T *)p;
+    struct destroy { T *t; ~destroy() { t->f_.~F(); operator delete(t, shared); } } d{t};
+    if(run) t->f_();
+  };
+  push(t);
+}
+
+inline shared_process_pool::shared_process_pool(size_t n_worker)
+  : n_worker_(n_worker ? n_worker : std::max(std::thread::hardware_concurrency(), 1u)),
+    inject_(4096), pending_(0), failed_(0), stop_(0)
+{
+  deques_ = shared_allocator<deque>().allocate(n_worker_);
+  for(size_t i = 0; i < n_worker_; ++i) new(&deques_[i]) deque;
+  try {
+    pids_.reserve(n_worker_);
+    for(size_t i = 0; i < n_worker_; ++i) {
+      pid_t pid = fork();
+      if(pid < 0) throw std::system_error(errno, std::system_category(), "fork");
+      if(pid == 0) {
+        self_ = i;
+        current_ = this;
+        work();
+        _exit(0);  // leave the segment to the creator
+      }
+      pids_.push_back(pid);
+    }
+  } catch(...) {
+    // Stop and reap the workers forked so far; they have no tasks yet.
+    stop_.store(1);
+    work_.notify();
+    for(pid_t pid : pids_) waitpid(pid, NULL, 0);
+    for(size_t i = 0; i < n_worker_; ++i) deques_[i].~deque();
+    shared_allocator<deque>().deallocate(deques_, n_worker_);
+    throw;
+  }
+}
+
+inline shared_process_pool::~shared_process_pool()
+{
+  stop_.store(1);
+  work_.notify();
+  for(pid_t pid : pids_) waitpid(pid, NULL, 0);
+
+  // Tasks nobody waited for are discarded.
+  for(size_t i = 0; i < n_worker_; ++i) {
+    while(task *t = deques_[i].pop()) t->run_(t, false);
+    deques_[i].~deque();
+  }
+  task *t;
+  while(inject_.try_pop(t)) t->run_(t, false);
+  shared_allocator<deque>().deallocate(deques_, n_worker_);
+}
+
+inline void shared_process_pool::wait()
+{
+  done_.wait([this] { return pending_.load() == 0; });
+  if(size_t n = failed_.exchange(0)) throw std::runtime_error(std::to_string(n) + " task(s) threw in shared_process_pool");
+}
+
+inline void shared_process_pool::push(task *t)
+{
+  pending_.fetch_add(1);
+  if(self_ < 0) {
+    inject_.push(t);  // workers drain it
+  } else if(!deques_[self_].push(t) && !inject_.try_push(t)) {
+    // Blocking here could deadlock with every worker doing the same.
+    finish(t);
+    return;
+  }
+  work_.notify();
+}
+
+inline shared_process_pool::task *shared_process_pool::take()
+{
+  task *t;
+  if((t = deques_[self_].pop())) return t;
+  if(inject_.try_pop(t)) return t;
+  for(size_t i = 1; i < n_worker_; ++i) {
+    if((t = deques_[(self_ + i) % n_worker_].steal())) return t;
+  }
+  return NULL;
+}
+
+inline bool shared_process_pool::has_work() const
+{
+  if(!inject_.empty()) return true;
+  for(size_t i = 0; i < n_worker_; ++i) {
+    if(!deques_[i].empty()) return true;
+  }
+  return false;
+}
+
+inline void shared_process_pool::work()
+{
+  for(;;) {
+    if(task *t = take()) {
+      finish(t);
+      continue;
+    }
+    if(stop_.load()) return;
+    work_.wait([this] { return stop_.load() || has_work(); });
+  }
+}
+
+inline void shared_process_pool::finish(task *t)
+{
+  try {
+    t->run_(t, true);
+  } catch(...) {
+    failed_.fetch_add(1);
+  }
+  if(pending_.fetch_sub(1) == 1) done_.notify();
+}
+
+inline bool shared_process_pool::deque::push(task *t)
+{
+  int64_t b = bottom_.load(std::memory_order_relaxed);
+  int64_t top = top_.load(std::memory_order_acquire);
+  if(b - top > mask_) return false;
+  slots_[b & mask_].store(t, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  bottom_.store(b + 1, std::memory_order_relaxed);
+  return true;
+}
+
+inline shared_process_pool::task *shared_process_pool::deque::pop()
+{
+  int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+  bottom_.store(b, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t t = top_.load(std::memory_order_relaxed);
+  if(t > b) {  // empty
+    bottom_.store(b + 1, std::memory_order_relaxed);
+    return NULL;
+  }
+  task *x = slots_[b & mask_].load(std::memory_order_relaxed);
+  if(t == b) {  // the last one: race against thieves
+    if(!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) x = NULL;
+    bottom_.store(b + 1, std::memory_order_relaxed);
+  }
+  return x;
+}
+
+inline shared_process_pool::task *shared_process_pool::deque::steal()
+{
+  int64_t t = top_.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t b = bottom_.load(std::memory_order_acquire);
+  if(t >= b) return NULL;
+  task *x = slots_[t & mask_].load(std::memory_order_relaxed);
+  if(!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) return NULL;
+  return x;
+}
@@ -0,0 +1,73 @@
+#include "shared_process_pool.h"
+#include <assert.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <iostream>
+
+using namespace std;
+
+static shared_process_pool *pool;
+static atomic<long> *total;
+static atomic<int> *workers_seen;
+
+// Recursive splitting makes workers push to their own deques and steal from others.
+static void split(long lo, long hi)
+{
+  if(hi - lo <= 64) {
+    long s = 0;
+    for(long i = lo; i < hi; ++i) s += i;
+    total->fetch_add(s);
+    workers_seen->fetch_or(1 << shared_process_pool::worker_index());
+    return;
+  }
+  long mid = lo + (hi - lo) / 2;
+  shared_process_pool::current()->submit([lo, mid] { split(lo, mid); });
+  split(mid, hi);
+}
+
+int main()
+{
+  global_shared_allocator::shm_open(NULL, O_RDWR | O_CREAT | O_TRUNC);
+  atexit(global_shared_allocator::shm_close);
+  global_shared_allocator::shm_unlink();
+  total = new(shared) atomic<long>(0);
+  workers_seen = new(shared) atomic<int>(0);
+  pool = new(shared) shared_process_pool(4);
+  assert(pool->size() == 4 && shared_process_pool::worker_index() == -1 && !shared_process_pool::current());
+
+  // Independent tasks writing to a shared vector.
+  auto *v = new(shared) shared_vector<long>(10000);
+  for(size_t i = 0; i < v->size(); ++i) pool->submit([v, i] { (*v)[i] = i * i; });
+  pool->wait();
+  for(size_t i = 0; i < v->size(); ++i) assert((*v)[i] == (long)(i * i));
+
+  // Nested submissions.
+  constexpr long n = 1 << 20;
+  pool->submit([] { split(0, n); });
+  pool->wait();
+  assert(*total == n * (n - 1) / 2);
+  assert(*workers_seen != 0);
+
+  // Every worker floods its own deque and the injection queue: overflow runs inline.
+  total->store(0);
+  for(int w = 0; w < 4; ++w) {
+    pool->submit([] {
+      for(int i = 0; i < 20000; ++i) shared_process_pool::current()->submit([] { total->fetch_add(1); });
+    });
+  }
+  pool->wait();
+  assert(*total == 4 * 20000);
+
+  // Failures are reported to the waiter.
+  pool->submit([] { throw runtime_error("oops"); });
+  pool->submit([] { });
+  bool thrown = false;
+  try { pool->wait(); } catch(runtime_error &) { thrown = true; }
+  assert(thrown);
+  pool->wait();
+
+  pool->~shared_process_pool();
+  operator delete(pool, shared);
+  cout << "passed" << endl;
+  return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * Bounded lock-free ring queues for inter-process message passing.
+ *
+ * Both the queue object and its slots must live in the shared memory:
+ *   auto *q = new(shared) shared_mpmc_queue<int>(1024);
+ * Capacities are rounded up to powers of 2.
+ *
+ * Written by <lyazj@github.com>.
+ */
+#pragma once
+#include "shared_sync.h"
+#include <utility>
+#include <stdexcept>
+#include <stddef.h>
+
+inline size_t shared_queue_capacity(size_t n)
+{
+  if(n == 0) throw std::invalid_argument("zero queue capacity");
+  size_t c = 1;
+  while(c < n) c <<= 1;
+  return c;
+}
+
+// Single-producer single-consumer queue.
+template<class T>
+class shared_spsc_queue {
+public:
+  explicit shared_spsc_queue(size_t capacity)
+    : head_(0), cached_tail_(0), tail_(0), cached_head_(0),
+      mask_(shared_queue_capacity(capacity) - 1), slots_(shared_allocator<T>().allocate(mask_ + 1)) { }
+  ~shared_spsc_queue()
+  {
+    for(size_t h = head_.load(), t = tail_.load(); h != t; ++h) slots_[h & mask_].~T();
+    shared_allocator<T>().deallocate(slots_, mask_ + 1);
+  }
+  shared_spsc_queue(const shared_spsc_queue &) = delete;
+  shared_spsc_queue &operator=(const shared_spsc_queue &) = delete;
+
+  // Producer side.
+  template<class... Args> bool try_emplace(Args &&...args)
+  {
+    size_t t = tail_.load(std::memory_order_relaxed);
+    if(t - cached_head_ > mask_) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+      if(t - cached_head_ > mask_) return false;
+    }
+    new(&slots_[t & mask_]) T(std::forward<Args>(args)...);
+    tail_.store(t + 1, std::memory_order_release);
+    not_empty_.notify();
+    return true;
+  }
+  bool try_push(const T &v) { return try_emplace(v); }
+  bool try_push(T &&v) { return try_emplace(std::move(v)); }
+  void push(T v)
+  {
+    while(!try_push(std::move(v))) not_full_.wait([this] { return !full(); });
+  }
+
+  // Consumer side.
+  bool try_pop(T &v)
+  {
+    size_t h = head_.load(std::memory_order_relaxed);
+    if(h == cached_tail_) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+      if(h == cached_tail_) return false;
+    }
+    T &s = slots_[h & mask_];
+    v = std::move(s);
+    s.~T();
+    head_.store(h + 1, std::memory_order_release);
+    not_full_.notify();
+    return true;
+  }
+  void pop(T &v)
+  {
+    while(!try_pop(v)) not_empty_.wait([this] { return !empty(); });
+  }
+
+  // Snapshots only.
+  bool empty() const { return head_.load() == tail_.load(); }
+  bool full() const { return tail_.load() - head_.load() > mask_; }
+  size_t size() const { return tail_.load() - head_.load(); }
+  size_t capacity() const { return mask_ + 1; }
+
+private:
+  // Consumer-owned.
+  std::atomic<size_t> head_;
+  size_t cached_tail_;
+  char pad0_[shared_cache_line - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+
+  // Producer-owned.
+  std::atomic<size_t> tail_;
+  size_t cached_head_;
+  char pad1_[shared_cache_line - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+
+  // Read-only after construction.
+  const size_t mask_;
+  T *const slots_;
+  char pad2_[shared_cache_line - sizeof(size_t) - sizeof(T *)];
+
+  shared_event_count not_empty_, not_full_;
+};
+
+// Multi-producer multi-consumer queue after Dmitry Vyukov's bounded MPMC queue.
+template<class T>
+class shared_mpmc_queue {
+public:
+  explicit shared_mpmc_queue(size_t capacity)
+    : enqueue_pos_(0), dequeue_pos_(0),
+      mask_(shared_queue_capacity(capacity) - 1), cells_(shared_allocator<cell>().allocate(mask_ + 1))
+  {
+    for(size_t i = 0; i <= mask_; ++i) new(&cells_[i].seq_) std::atomic<size_t>(i);
+  }
+  ~shared_mpmc_queue()
+  {
+    for(size_t d = dequeue_pos_.load(), e = enqueue_pos_.load(); d != e; ++d) cells_[d & mask_].value()->~T();
+    shared_allocator<cell>().deallocate(cells_, mask_ + 1);
+  }
+  shared_mpmc_queue(const shared_mpmc_queue &) = delete;
+  shared_mpmc_queue &operator=(const shared_mpmc_queue &) = delete;
+
+  template<class... Args> bool try_emplace(Args &&...args)
+  {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    cell *c;
+    for(;;) {
+      c = &cells_[pos & mask_];
+      size_t seq = c->seq_.load(std::memory_order_acquire);
+      ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+      if(diff == 0) {
+        if(enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      } else if(diff < 0) {
+        return false;  // full
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    new(c->value()) T(std::forward<Args>(args)...);
+    c->seq_.store(pos + 1, std::memory_order_release);
+    not_empty_.notify();
+    return true;
+  }
+  bool try_push(const T &v) { return try_emplace(v); }
+  bool try_push(T &&v) { return try_emplace(std::move(v)); }
+  void push(T v)
+  {
+    while(!try_push(std::move(v))) not_full_.wait([this] { return !full(); });
+  }
+
+  bool try_pop(T &v)
+  {
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    cell *c;
+    for(;;) {
+      c = &cells_[pos & mask_];
+      size_t seq = c->seq_.load(std::memory_order_acquire);
+      ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+      if(diff == 0) {
+        if(dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+      } else if(diff < 0) {
+        return false;  // empty
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    T *p = c->value();
+    v = std::move(*p);
+    p->~T();
+    c->seq_.store(pos + mask_ + 1, std::memory_order_release);
+    not_full_.notify();
+    return true;
+  }
+  void pop(T &v)
+  {
+    while(!try_pop(v)) not_empty_.wait([this] { return !empty(); });
+  }
+
+  // Snapshots only.
+  bool empty() const
+  {
+    size_t pos = dequeue_pos_.load();
+    return cells_[pos & mask_].seq_.load() != pos + 1;
+  }
+  bool full() const
+  {
+    size_t pos = enqueue_pos_.load();
+    return cells_[pos & mask_].seq_.load() != pos;
+  }
+  size_t size() const
+  {
+    size_t d = dequeue_pos_.load(), e = enqueue_pos_.load();
+    return e > d ? e - d : 0;
+  }
+  size_t capacity() const { return mask_ + 1; }
+
+private:
+  struct cell {
+    std::atomic<size_t> seq_;
+    alignas(T) unsigned char storage_[sizeof(T)];
+    T *value() { return (T *)storage_; }
+  };
+
+  std::atomic<size_t> enqueue_pos_;
+  char pad0_[shared_cache_line - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> dequeue_pos_;
+  char pad1_[shared_cache_line - sizeof(std::atomic<size_t>)];
+  const size_t mask_;
+  cell *const cells_;
+  char pad2_[shared_cache_line - sizeof(size_t) - sizeof(cell *)];
+
+  shared_event_count not_empty_, not_full_;
+};
@@ -0,0 +1,68 @@
+#include "shared_queue.h"
+#include "shared_container.h"
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <iostream>
+
+using namespace std;
+
+static pid_t spawn(void (*f)(int), int arg)
+{
+  pid_t pid = fork();
+  if(pid < 0) err(EXIT_FAILURE, "fork");
+  if(pid == 0) { f(arg); _exit(0); }
+  return pid;
+}
+
+static void wait_all()
+{
+  int status;
+  while(wait(&status) > 0) assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static constexpr long n_item = 200000;
+static constexpr int n_producer = 3, n_consumer = 3;
+static shared_spsc_queue<long> *spsc;
+static shared_mpmc_queue<long> *mpmc;
+static shared_vector<long> *sums;
+
+int main()
+{
+  global_shared_allocator::shm_open(NULL, O_RDWR | O_CREAT | O_TRUNC);
+  atexit(global_shared_allocator::shm_close);
+  global_shared_allocator::shm_unlink();
+
+  // SPSC: the consumer must see items in order.
+  spsc = new(shared) shared_spsc_queue<long>(100);
+  assert(spsc->capacity() == 128 && spsc->empty());
+  spawn([](int) { for(long i = 0; i < n_item; ++i) spsc->push(i); }, 0);
+  for(long i = 0, v; i < n_item; ++i) {
+    spsc->pop(v);
+    assert(v == i);
+  }
+  wait_all();
+  assert(spsc->empty());
+
+  // MPMC: nothing is lost nor duplicated.
+  mpmc = new(shared) shared_mpmc_queue<long>(64);
+  sums = new(shared) shared_vector<long>(n_consumer);
+  for(int c = 0; c < n_consumer; ++c) spawn([](int c) {
+    for(long i = 0, v; i < n_item; ++i) {
+      mpmc->pop(v);
+      (*sums)[c] += v;
+    }
+  }, c);
+  for(int p = 0; p < n_producer; ++p) spawn([](int) {
+    for(long i = 0; i < n_item; ++i) mpmc->push(i);
+  }, p);
+  wait_all();
+  long sum = 0;
+  for(long s : *sums) sum += s;
+  assert(sum == n_producer * (n_item * (n_item - 1) / 2));
+  assert(mpmc->empty() && !mpmc->try_pop(sum));
+  cout << "passed" << endl;
+  return 0;
+}
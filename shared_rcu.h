@@ -0,0 +1,74 @@
+/*
+ * Read-copy-update publication of read-mostly shared objects.
+ *
+ * Writers build a new version in the shared memory and publish it with an
+ * atomic pointer swap. Readers stay inside an allocator epoch while they
+ * hold a read guard. An old version is destroyed once every reader that
+ * could still see it has left, i.e. after a grace period:
+ *   auto *table = new(shared) shared_rcu_ptr<routing_table>(new(shared) routing_table);
+ *   { auto r = table->read(); route(r->lookup(key)); }  // readers
+ *   table->update(new(shared) routing_table(...));      // writers
+ *
+ * Written by <lyazj@github.com>.
+ */
+#pragma once
+#include "shared_sync.h"
+
+template<class T>
+class shared_rcu_ptr {
+public:
+  // Takes ownership of p, which must come from `new(shared)`.
+  explicit shared_rcu_ptr(T *p = NULL) : ptr_(p) { }
+  ~shared_rcu_ptr() { destroy(ptr_.load()); }
+  shared_rcu_ptr(const shared_rcu_ptr &) = delete;
+  shared_rcu_ptr &operator=(const shared_rcu_ptr &) = delete;
+
+  // Keeps the version seen at construction alive. Guards may nest.
+  class read_guard {
+  public:
+    const T *get() const { return p_; }
+    const T *operator->() const { return p_; }
+    const T &operator*() const { return *p_; }
+    explicit operator bool() const { return p_ != NULL; }
+    ~read_guard() { global_shared_allocator::epoch_leave(); }
+    read_guard(const read_guard &) = delete;
+    read_guard &operator=(const read_guard &) = delete;
+
+  private:
+    friend class shared_rcu_ptr;
+    const T *p_;
+    read_guard(shared_rcu_ptr &r)
+    {
+      global_shared_allocator::epoch_enter();
+      p_ = r.ptr_.load();
+    }
+  };
+  read_guard read() { return read_guard(*this); }
+
+  // Publish p and destroy the previous version after a grace period.
+  // Concurrent writers each wait for their own grace period.
+  void update(T *p) { destroy(exchange(p)); }
+
+  // Publish p and return the previous version once no reader can see it.
+  // The swap alone orders writers; no lock is held while waiting.
+  T *exchange(T *p)
+  {
+    T *old = ptr_.exchange(p);
+    synchronize();
+    return old;
+  }
+
+  // Wait until every read guard taken before the call has been released.
+  // Epochs are global, so guards of other shared_rcu_ptrs are waited for too.
+  void synchronize() { global_shared_allocator::synchronize(); }
+
+private:
+  std::atomic<T *> ptr_;
+
+  static void destroy(T *p)
+  {
+    if(!p) return;
+    p->~T();
+    operator delete(p, shared);
+  }
+};
@@ -0,0 +1,76 @@
+#include "shared_rcu.h"
+#include "shared_container.h"
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <iostream>
+
+using namespace std;
+
+// Every version maps each key to the same value.
+struct table {
+  shared_unordered_map<int, long> m;
+  explicit table(long v) { for(int k = 0; k < 64; ++k) m[k] = v; }
+};
+
+static constexpr int n_reader = 6, n_update = 2000;
+static shared_rcu_ptr<table> *rcu;
+
+int main()
+{
+  global_shared_allocator::shm_open(NULL, O_RDWR | O_CREAT | O_TRUNC);
+  atexit(global_shared_allocator::shm_close);
+  global_shared_allocator::shm_unlink();
+  rcu = new(shared) shared_rcu_ptr<table>(new(shared) table(0));
+
+  // Readers see consistent versions that are never destroyed under them.
+  for(int p = 0; p < n_reader; ++p) {
+    pid_t pid = fork();
+    if(pid < 0) err(EXIT_FAILURE, "fork");
+    if(pid) continue;
+    for(long last = 0; last < n_update - 1;) {
+      sched_yield();  // readers may outnumber CPUs; let the writer run
+      auto r = rcu->read();
+      long v = r->m.at(0);
+      assert(v >= last);
+      {
+        auto nested = rcu->read();
+        (void)nested;
+        for(int k = 0; k < 64; ++k) assert(r->m.at(k) == v);
+      }
+      last = v;
+    }
+    _exit(0);
+  }
+  for(long v = 1; v < n_update; ++v) rcu->update(new(shared) table(v));
+  int status;
+  while(wait(&status) > 0) assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  // Concurrent writers each free exactly the version they replaced.
+  for(int p = 0; p < 4; ++p) {
+    pid_t pid = fork();
+    if(pid < 0) err(EXIT_FAILURE, "fork");
+    if(pid) continue;
+    for(int i = 0; i < 200; ++i) rcu->update(new(shared) table(n_update + p));
+    _exit(0);
+  }
+  while(wait(&status) > 0) assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  long v = rcu->read()->m.at(0);
+  assert(v >= n_update && v < n_update + 4);
+
+  // A reader dying inside a guard does not block writers forever.
+  pid_t pid = fork();
+  if(pid == 0) {
+    auto r = rcu->read();
+    _exit(0);
+  }
+  waitpid(pid, &status, 0);
+  rcu->update(new(shared) table(n_update));
+  assert(rcu->read()->m.at(63) == n_update);
+  rcu->~shared_rcu_ptr();
+  operator delete(rcu, shared);
+  cout << "passed" << endl;
+  return 0;
+}
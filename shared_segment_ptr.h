@@ -0,0 +1,128 @@
+/*
+ * Smart pointers to objects in the shared memory.
+ *
+ * Pointers are valid in every process because the segment is mapped at the
+ * same address everywhere, so the smart pointers themselves may be stored in
+ * the shared memory, e.g. in queues, to pass ownership between processes:
+ *   auto p = make_shared_segment<image>(1920, 1080);  // refcount and object in one block
+ *   q->push(p);                                       // another process pops a copy
+ *
+ * No function pointers are kept in the segment as they differ among
+ * executables: the deleter is the static type, which must be the exact
+ * type created, so there are no conversions to base classes.
+ *
+ * Written by <lyazj@github.com>.
+ */
+#pragma once
+#include "shared_allocator.h"
+#include <atomic>
+#include <utility>
+#include <stddef.h>
+
+// Reference-counted ownership. Copies are lock-free.
+template<class T>
+class shared_segment_ptr {
+  struct block {
+    std::atomic<size_t> use_;
+    T value_;
+    template<class... Args> block(Args &&...args) : use_(1), value_(std::forward<Args>(args)...) { }
+  };
+
+public:
+  typedef T element_type;
+
+  shared_segment_ptr() : b_(NULL) { }
+  shared_segment_ptr(std::nullptr_t) : b_(NULL) { }
+  shared_segment_ptr(const shared_segment_ptr &o) : b_(o.b_) { if(b_) b_->use_.fetch_add(1, std::memory_order_relaxed); }
+  shared_segment_ptr(shared_segment_ptr &&o) : b_(o.b_) { o.b_ = NULL; }
+  ~shared_segment_ptr() { reset(); }
+  shared_segment_ptr &operator=(shared_segment_ptr o) { swap(o); return *this; }
+
+  T *get() const { return b_ ? &b_->value_ : NULL; }
+  T &operator*() const { return b_->value_; }
+  T *operator->() const { return &b_->value_; }
+  explicit operator bool() const { return b_ != NULL; }
+  size_t use_count() const { return b_ ? b_->use_.load(std::memory_order_relaxed) : 0; }
+
+  void reset()
+  {
+    if(!b_) return;
+    if(b_->use_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      b_->~block();
+      global_shared_allocator::deallocate(b_, sizeof(block));
+    }
+    b_ = NULL;
+  }
+  void swap(shared_segment_ptr &o) { std::swap(b_, o.b_); }
+
+  // Give up the reference without dropping it, e.g. to pass it through a raw channel.
+  // adopt() takes it back, possibly in another process.
+  void *release() { return std::exchange(b_, (block *)NULL); }
+  static shared_segment_ptr adopt(void *handle) { shared_segment_ptr p; p.b_ = (block *)handle; return p; }
+
+  template<class U, class... Args> friend shared_segment_ptr<U> make_shared_segment(Args &&...args);
+
+  friend bool operator==(const shared_segment_ptr &a, const shared_segment_ptr &b) { return a.b_ == b.b_; }
+  friend bool operator!=(const shared_segment_ptr &a, const shared_segment_ptr &b) { return a.b_ != b.b_; }
+
+private:
+  block *b_;
+};
+
+// One allocation for the object and its reference count.
+template<class T, class... Args>
+shared_segment_ptr<T> make_shared_segment(Args &&...args)
+{
+  typedef typename shared_segment_ptr<T>::block block;
+  void *p = global_shared_allocator::allocate(sizeof(block));
+  try {
+    return shared_segment_ptr<T>::adopt(new(p) block(std::forward<Args>(args)...));
+  } catch(...) {
+    global_shared_allocator::deallocate(p, sizeof(block));
+    throw;
+  }
+}
+
+// Exclusive ownership of an object created by `new(shared)` or make_shared_unique().
+template<class T>
+class shared_unique_ptr {
+public:
+  typedef T element_type;
+
+  shared_unique_ptr() : p_(NULL) { }
+  shared_unique_ptr(std::nullptr_t) : p_(NULL) { }
+  explicit shared_unique_ptr(T *p) : p_(p) { }
+  shared_unique_ptr(shared_unique_ptr &&o) : p_(o.release()) { }
+  ~shared_unique_ptr() { reset(); }
+  shared_unique_ptr &operator=(shared_unique_ptr o) { swap(o); return *this; }
+
+  T *get() const { return p_; }
+  T &operator*() const { return *p_; }
+  T *operator->() const { return p_; }
+  explicit operator bool() const { return p_ != NULL; }
+
+  T *release() { return std::exchange(p_, (T *)NULL); }
+  void reset(T *p = NULL)
+  {
+    if(T *old = std::exchange(p_, p)) {
+      old->~T();
+      global_shared_allocator::deallocate(old, sizeof(T));
+    }
+  }
+  void swap(shared_unique_ptr &o) { std::swap(p_, o.p_); }
+
+private:
+  T *p_;
+};
+
+template<class T, class... Args>
+shared_unique_ptr<T> make_shared_unique(Args &&...args)
+{
+  void *p = global_shared_allocator::allocate(sizeof(T));
+  try {
+    return shared_unique_ptr<T>(new(p) T(std::forward<Args>(args)...));
+  } catch(...) {
+    global_shared_allocator::deallocate(p, sizeof(T));
+    throw;
+  }
+}
@@ -0,0 +1,80 @@
+#include "shared_segment_ptr.h"
+#include "shared_queue.h"
+#include "shared_container.h"
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <iostream>
+
+using namespace std;
+
+static atomic<long> *alive;
+
+struct payload {
+  shared_vector<long> data;
+  explicit payload(long n) : data(n, n) { alive->fetch_add(1); }
+  ~payload() { alive->fetch_sub(1); }
+};
+
+static constexpr int n_consumer = 4;
+static constexpr long n_item = 20000;
+static shared_mpmc_queue<shared_segment_ptr<payload>> *q;
+static shared_mpmc_queue<void *> *raw;
+
+int main()
+{
+  global_shared_allocator::shm_open(NULL, O_RDWR | O_CREAT | O_TRUNC);
+  atexit(global_shared_allocator::shm_close);
+  global_shared_allocator::shm_unlink();
+  alive = new(shared) atomic<long>(0);
+
+  // Basic ownership.
+  {
+    auto p = make_shared_segment<payload>(3);
+    assert(p.use_count() == 1 && p->data.size() == 3);
+    auto c = p;
+    assert(p.use_count() == 2 && c == p);
+    auto m = std::move(c);
+    assert(!c && p.use_count() == 2);
+    p.reset();
+    assert(!p && m.use_count() == 1 && *alive == 1);
+    auto u = make_shared_unique<payload>(5);
+    assert(u->data[4] == 5 && *alive == 2);
+    shared_unique_ptr<payload> v = std::move(u);
+    assert(!u && v);
+  }
+  assert(*alive == 0);
+
+  // Every process drops its copies; the last one destroys.
+  q = new(shared) shared_mpmc_queue<shared_segment_ptr<payload>>(64);
+  raw = new(shared) shared_mpmc_queue<void *>(n_item);  // never blocks the consumers
+  for(int c = 0; c < n_consumer; ++c) {
+    pid_t pid = fork();
+    if(pid < 0) err(EXIT_FAILURE, "fork");
+    if(pid) continue;
+    for(;;) {
+      shared_segment_ptr<payload> p;
+      q->pop(p);
+      if(!p) break;
+      assert((long)p->data.size() == p->data[0]);
+      raw->push(p.release());  // to the parent
+    }
+    _exit(0);
+  }
+  for(long i = 1; i <= n_item; ++i) {
+    auto p = make_shared_segment<payload>(i % 8 + 1);
+    q->push(p);
+    void *h;
+    if(raw->try_pop(h)) shared_segment_ptr<payload>::adopt(h);
+  }
+  for(int c = 0; c < n_consumer; ++c) q->push(nullptr);
+  int status;
+  while(wait(&status) > 0) assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  void *h;
+  while(raw->try_pop(h)) shared_segment_ptr<payload>::adopt(h);
+  assert(*alive == 0);
+  cout << "passed" << endl;
+  return 0;
+}
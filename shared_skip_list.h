@@ -0,0 +1,280 @@
+/*
+ * Concurrent ordered map shared by processes.
+ *
+ * A lazy skip list: updates lock only the predecessors of the affected node,
+ * lookups and scans take no lock at all. Each node is one allocation whose
+ * tower of next pointers has its own height. Erased nodes are retired to the
+ * allocator and freed after every reader that might see them has left its
+ * epoch (see global_shared_allocator::retire()).
+ *
+ * Erased values are not destroyed while readers may still copy them, so
+ * keys and values must be trivially destructible: numbers, fixed-size
+ * records, shared_slot_map handles and the like.
+ *
+ * Written by <lyazj@github.com>.
+ */
+#pragma once
+#include "shared_sync.h"
+#include <utility>
+#include <functional>
+#include <type_traits>
+#include <stddef.h>
+#include <stdint.h>
+
+template<class K, class V, class C = std::less<K>>
+class shared_skip_list {
+  static_assert(std::is_trivially_destructible_v<K> && std::is_trivially_destructible_v<V>);
+
+public:
+  typedef K key_type;
+  typedef V mapped_type;
+  typedef std::pair<const K, V> value_type;
+
+  shared_skip_list();
+  ~shared_skip_list();
+  shared_skip_list(const shared_skip_list &) = delete;
+  shared_skip_list &operator=(const shared_skip_list &) = delete;
+
+  // Returns false without touching the map if the key exists.
+  bool insert(const K &k, const V &v);
+  bool erase(const K &k);
+
+  // Copies the value out on success.
+  bool find(const K &k, V &v) const;
+  bool contains(const K &k) const;
+
+  // Calls f(const value_type &) in key order, for all elements or those in [lo, hi).
+  // Elements concurrently inserted or erased may or may not be visited.
+  template<class F> void for_each(F f) const
+  {
+    shared_epoch_guard g;
+    scan(head_->next_[0].load(), NULL, f);
+  }
+  template<class F> void for_each(const K &lo, const K &hi, F f) const;
+
+  size_t size() const { return size_.load(std::memory_order_relaxed); }
+  bool empty() const { return size() == 0; }
+
+private:
+  // 2^24 elements are indexed at the ideal depth.
+  static inline constexpr int max_height_ = 24;
+
+  struct node {
+    union { value_type value_; };  // unused in head_
+    shared_spinlock lock_;
+    std::atomic<uint8_t> marked_;  // logically erased
+    std::atomic<uint8_t> linked_;  // inserted at all levels
+    uint8_t height_;
+    std::atomic<node *> next_[1];  // height_ of them, NULL ends a level
+
+    explicit node(int height) : marked_(0), linked_(0), height_(height)
+    {
+      for(int i = 0; i < height; ++i) new(&next_[i]) std::atomic<node *>(NULL);
+    }
+    ~node() { }
+    static size_t bytes(int height) { return sizeof(node) + (height - 1) * sizeof(std::atomic<node *>); }
+  };
+
+  node *head_;
+  std::atomic<size_t> size_;
+
+  static node *make_node(int height) { return new(global_shared_allocator::allocate(node::bytes(height))) node(height); }
+  static bool less(const node *n, const K &k) { return n && C()(n->value_.first, k); }
+  static bool equal(const node *n, const K &k) { return n && !C()(k, n->value_.first); }
+  static int random_height();
+
+  // Fill the neighbourhood of k at every level. Returns the highest level at which k was found, or -1.
+  int search(const K &k, node **preds, node **succs) const;
+
+  // Lock preds[0, height) once each and check that preds[i]->next_[i] == succs[i] and that
+  // both are live, except for the victim of an erasure.
+  bool lock_preds(node **preds, node **succs, int height, int &locked, const node *victim) const;
+  static void unlock_preds(node **preds, int locked);
+
+  // Inside an epoch.
+  template<class F> static void scan(const node *n, const K *hi, F &f);
+};
+
+template<class K, class V, class C>
+shared_skip_list<K, V, C>::shared_skip_list() : head_(make_node(max_height_)), size_(0)
+{
+  head_->linked_.store(1);
+}
+
+template<class K, class V, class C>
+shared_skip_list<K, V, C>::~shared_skip_list()
+{
+  node *n = head_;
+  while(n) {
+    node *next = n->next_[0].load();
+    size_t bytes = node::bytes(n->height_);
+    n->~node();
+    global_shared_allocator::deallocate(n, bytes);
+    n = next;
+  }
+}
+
+template<class K, class V, class C>
+bool shared_skip_list<K, V, C>::insert(const K &k, const V &v)
+{
+  int height = random_height();
+  node *preds[max_height_], *succs[max_height_];
+  shared_epoch_guard g;
+  for(;;) {
+    int found = search(k, preds, succs);
+    if(found >= 0) {
+      node *n = succs[found];
+      if(n->marked_.load()) continue;  // being erased; retry after it is unlinked
+      while(!n->linked_.load()) cpu_relax();
+      return false;
+    }
+    int locked;
+    if(!lock_preds(preds, succs, height, locked, NULL)) {
+      unlock_preds(preds, locked);
+      continue;
+    }
+    node *n = make_node(height);
+    new(&n->value_) value_type(k, v);
+    for(int i = 0; i < height; ++i) n->next_[i].store(succs[i], std::memory_order_relaxed);
+    for(int i = 0; i < height; ++i) preds[i]->next_[i].store(n, std::memory_order_release);
+    n->linked_.store(1);
+    unlock_preds(preds, locked);
+    size_.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+}
+
+template<class K, class V, class C>
+bool shared_skip_list<K, V, C>::erase(const K &k)
+{
+  node *preds[max_height_], *succs[max_height_];
+  node *victim = NULL;
+  shared_epoch_guard g;
+  for(;;) {
+    int found = search(k, preds, succs);
+    if(!victim) {
+      if(found < 0) return false;
+      node *n = succs[found];
+
+      // Only a fully linked node found at its top level is ready to go.
+      if(!n->linked_.load() || n->height_ - 1 != found || n->marked_.load()) return false;
+      std::lock_guard<shared_spinlock> l(n->lock_);
+      if(n->marked_.load()) return false;
+      n->marked_.store(1);
+      victim = n;
+    }
+    int locked;
+    if(!lock_preds(preds, succs, victim->height_, locked, victim)) {
+      unlock_preds(preds, locked);
+      continue;
+    }
+    for(int i = victim->height_ - 1; i >= 0; --i) preds[i]->next_[i].store(victim->next_[i].load(), std::memory_order_release);
+    unlock_preds(preds, locked);
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    global_shared_allocator::retire(victim, node::bytes(victim->height_));
+    return true;
+  }
+}
+
+template<class K, class V, class C>
+bool shared_skip_list<K, V, C>::find(const K &k, V &v) const
+{
+  node *preds[max_height_], *succs[max_height_];
+  shared_epoch_guard g;
+  int found = search(k, preds, succs);
+  if(found < 0) return false;
+  node *n = succs[found];
+  if(!n->linked_.load() || n->marked_.load()) return false;
+  v = n->value_.second;
+  return true;
+}
+
+template<class K, class V, class C>
+bool shared_skip_list<K, V, C>::contains(const K &k) const
+{
+  node *preds[max_height_], *succs[max_height_];
+  shared_epoch_guard g;
+  int found = search(k, preds, succs);
+  return found >= 0 && succs[found]->linked_.load() && !succs[found]->marked_.load();
+}
+
+template<class K, class V, class C>
+template<class F>
+void shared_skip_list<K, V, C>::for_each(const K &lo, const K &hi, F f) const
+{
+  shared_epoch_guard g;
+  node *n = head_;
+  for(int i = max_height_ - 1; i >= 0; --i) {
+    for(node *next = n->next_[i].load(); less(next, lo); next = n->next_[i].load()) n = next;
+  }
+  scan(n->next_[0].load(), &hi, f);
+}
+
+template<class K, class V, class C>
+template<class F>
+void shared_skip_list<K, V, C>::scan(const node *n, const K *hi, F &f)
+{
+  for(; n && !(hi && !C()(n->value_.first, *hi)); n = n->next_[0].load()) {
+    if(n->linked_.load() && !n->marked_.load()) f((const value_type &)n->value_);
+  }
+}
+
+template<class K, class V, class C>
+int shared_skip_list<K, V, C>::random_height()
+{
+  // Geometric with p = 1/2, from a per-thread xorshift. Forked children inherit the state,
+  // so it is reseeded whenever the thread id differs from the one it was seeded for.
+  static thread_local uint64_t x;
+  static thread_local pid_t seeded;
+  pid_t tid = shared_tid();
+  if(seeded != tid) {
+    seeded = tid;
+    x = (uint64_t)tid * 0x9e3779b97f4a7c15 | 1;
+  }
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return __builtin_ctzll(x | (uint64_t)1 << (max_height_ - 1)) + 1;
+}
+
+template<class K, class V, class C>
+int shared_skip_list<K, V, C>::search(const K &k, node **preds, node **succs) const
+{
+  int found = -1;
+  node *pred = head_;
+  for(int i = max_height_ - 1; i >= 0; --i) {
+    node *curr = pred->next_[i].load();
+    while(less(curr, k)) {
+      pred = curr;
+      curr = pred->next_[i].load();
+    }
+    if(found < 0 && equal(curr, k)) found = i;
+    preds[i] = pred;
+    succs[i] = curr;
+  }
+  return found;
+}
+
+template<class K, class V, class C>
+bool shared_skip_list<K, V, C>::lock_preds(node **preds, node **succs, int height, int &locked, const node *victim) const
+{
+  // Levels are locked bottom up; a predecessor shared by several levels is locked once.
+  for(locked = 0; locked < height; ++locked) {
+    node *pred = preds[locked], *succ = succs[locked];
+    if(locked == 0 || pred != preds[locked - 1]) pred->lock_.lock();
+    bool valid = !pred->marked_.load() && pred->next_[locked].load() == succ && (!succ || succ == victim || !succ->marked_.load());
+    if(!valid) {
+      ++locked;
+      return false;
+    }
+  }
+  return true;
+}
+
+template<class K, class V, class C>
+void shared_skip_list<K, V, C>::unlock_preds(node **preds, int locked)
+{
+  for(int i = 0; i < locked; ++i) {
+    if(i == 0 || preds[i] != preds[i - 1]) preds[i]->lock_.unlock();
+  }
+}
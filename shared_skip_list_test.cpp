@@ -0,0 +1,81 @@
+#include "shared_skip_list.h"
+#include <map>
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <iostream>
+
+using namespace std;
+
+static constexpr int n_writer = 4, n_key = 20000;
+static shared_skip_list<long, long> *sl;
+static atomic<int> *done;
+
+int main()
+{
+  global_shared_allocator::shm_open(NULL, O_RDWR | O_CREAT | O_TRUNC);
+  atexit(global_shared_allocator::shm_close);
+  global_shared_allocator::shm_unlink();
+
+  // Single process against a reference.
+  {
+    shared_skip_list<long, long> s;
+    map<long, long> ref;
+    srand(1);
+    for(int i = 0; i < 20000; ++i) {
+      long k = rand() % 2000;
+      if(rand() % 3) {
+        assert(s.insert(k, -k) == ref.emplace(k, -k).second);
+      } else {
+        assert(s.erase(k) == (bool)ref.erase(k));
+      }
+    }
+    assert(s.size() == ref.size());
+    auto it = ref.begin();
+    s.for_each([&](const pair<const long, long> &p) { assert(it != ref.end() && p == *it++); });
+    assert(it == ref.end());
+    it = ref.lower_bound(500);
+    s.for_each(500, 1500, [&](const pair<const long, long> &p) { assert(p == *it++); });
+    assert(it == ref.lower_bound(1500));
+    long v = 0;
+    for(long k = 0; k < 2000; ++k) assert(s.find(k, v) == ref.count(k) && (!ref.count(k) || v == -k));
+  }
+
+  // Writers insert interleaved keys and erase the odd ones while a reader scans.
+  sl = new(shared) shared_skip_list<long, long>;
+  done = new(shared) atomic<int>(0);
+  for(int w = 0; w < n_writer; ++w) {
+    pid_t pid = fork();
+    if(pid < 0) err(EXIT_FAILURE, "fork");
+    if(pid) continue;
+    for(long k = w; k < n_key; k += n_writer) assert(sl->insert(k, k * 2));
+    for(long k = w; k < n_key; k += n_writer) {
+      if(k % 2) assert(sl->erase(k));
+    }
+    done->fetch_add(1);
+    _exit(0);
+  }
+  pid_t reader = fork();
+  if(reader == 0) {
+    while(done->load() < n_writer) {
+      long last = -1;
+      sl->for_each([&](const pair<const long, long> &p) {
+        assert(p.first > last && p.second == p.first * 2);
+        last = p.first;
+      });
+    }
+    _exit(0);
+  }
+  int status;
+  while(wait(&status) > 0) assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  assert(sl->size() == n_key / 2);
+  long expect = 0;
+  sl->for_each([&](const pair<const long, long> &p) { assert(p.first == expect); expect += 2; });
+  assert(expect == n_key);
+  sl->~shared_skip_list();
+  operator delete(sl, shared);
+  cout << "passed" << endl;
+  return 0;
+}
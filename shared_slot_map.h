@@ -0,0 +1,149 @@
+/*
+ * Slot map with generation-checked handles.
+ *
+ * Values are stored densely in a shared_vector and referred to by 64-bit
+ * handles packing a slot index and the generation of the slot. Erasing bumps
+ * the generation, so stale handles are detected instead of reaching a reused
+ * block, which makes handles safe to pass between processes:
+ *   auto h = objects->insert(obj);  q->push(h);
+ *   if(T *p = objects->get(h)) ...  // NULL once erased
+ * Like std containers, it needs external locking across processes, e.g.
+ * shared_guarded<shared_slot_map<T>>.
+ *
+ * Written by <lyazj@github.com>.
+ */
+#pragma once
+#include "shared_container.h"
+#include <utility>
+#include <stdexcept>
+#include <stdint.h>
+
+template<class T>
+class shared_slot_map {
+public:
+  typedef uint64_t handle;
+  typedef T value_type;
+  typedef typename shared_vector<T>::iterator iterator;
+  typedef typename shared_vector<T>::const_iterator const_iterator;
+
+  // Never returned by insert().
+  static inline constexpr handle null_handle = 0;
+
+  template<class... Args> handle emplace(Args &&...args);
+  handle insert(const T &v) { return emplace(v); }
+  handle insert(T &&v) { return emplace(std::move(v)); }
+
+  // O(1). NULL if h was erased or never valid.
+  T *get(handle h) { return valid(h) ? &values_[slots_[index_of(h)].pos_] : NULL; }
+  const T *get(handle h) const { return ((shared_slot_map *)this)->get(h); }
+  bool contains(handle h) const { return valid(h); }
+  T &at(handle h)
+  {
+    if(!valid(h)) throw std::out_of_range("shared_slot_map::at");
+    return values_[slots_[index_of(h)].pos_];
+  }
+  const T &at(handle h) const { return ((shared_slot_map *)this)->at(h); }
+
+  // The last value moves into the hole; handles stay valid.
+  bool erase(handle h);
+  void clear();
+
+  // Dense iteration in unspecified order.
+  iterator begin() { return values_.begin(); }
+  iterator end() { return values_.end(); }
+  const_iterator begin() const { return values_.begin(); }
+  const_iterator end() const { return values_.end(); }
+  handle handle_of(const_iterator it) const
+  {
+    uint32_t i = owners_[it - values_.begin()];
+    return make_handle(i, slots_[i].gen_);
+  }
+
+  size_t size() const { return values_.size(); }
+  bool empty() const { return values_.empty(); }
+  void reserve(size_t n) { values_.reserve(n); owners_.reserve(n); slots_.reserve(n); }
+
+private:
+  // Odd generations are occupied, so null_handle is never valid.
+  struct slot {
+    uint32_t gen_;
+    uint32_t pos_;  // occupied: position in values_; free: next free slot
+  };
+
+  static inline constexpr uint32_t npos_ = UINT32_MAX;
+
+  shared_vector<T> values_;
+  shared_vector<uint32_t> owners_;  // slot of each value
+  shared_vector<slot> slots_;
+  uint32_t free_ = npos_;
+
+  static uint32_t index_of(handle h) { return (uint32_t)h; }
+  static uint32_t gen_of(handle h) { return h >> 32; }
+  static handle make_handle(uint32_t i, uint32_t gen) { return (handle)gen << 32 | i; }
+  bool valid(handle h) const
+  {
+    uint32_t i = index_of(h);
+    return i < slots_.size() && slots_[i].gen_ == gen_of(h) && (gen_of(h) & 1);
+  }
+};
+
+template<class T>
+template<class... Args>
+typename shared_slot_map<T>::handle shared_slot_map<T>::emplace(Args &&...args)
+{
+  if(values_.size() >= npos_) throw std::length_error("shared_slot_map: too many values");
+  values_.emplace_back(std::forward<Args>(args)...);
+  uint32_t i = free_;
+  try {
+    if(i == npos_) {
+      i = slots_.size();
+      slots_.push_back({0, 0});
+    }
+    owners_.push_back(i);
+  } catch(...) {
+    values_.pop_back();
+    throw;
+  }
+  slot &s = slots_[i];
+  if(i == free_) free_ = s.pos_;
+  s.pos_ = values_.size() - 1;
+  ++s.gen_;
+  return make_handle(i, s.gen_);
+}
+
+template<class T>
+bool shared_slot_map<T>::erase(handle h)
+{
+  if(!valid(h)) return false;
+  uint32_t i = index_of(h);
+  slot &s = slots_[i];
+  uint32_t pos = s.pos_, last = values_.size() - 1;
+  if(pos != last) {
+    values_[pos] = std::move(values_[last]);
+    owners_[pos] = owners_[last];
+    slots_[owners_[pos]].pos_ = pos;
+  }
+  values_.pop_back();
+  owners_.pop_back();
+
+  // A slot whose generation wraps around is retired for good.
+  if(++s.gen_ != 0) {
+    s.pos_ = free_;
+    free_ = i;
+  }
+  return true;
+}
+
+template<class T>
+void shared_slot_map<T>::clear()
+{
+  for(uint32_t i : owners_) {
+    slot &s = slots_[i];
+    if(++s.gen_ != 0) {
+      s.pos_ = free_;
+      free_ = i;
+    }
+  }
+  values_.clear();
+  owners_.clear();
+}
@@ -0,0 +1,64 @@
+#include "shared_slot_map.h"
+#include "shared_sync.h"
+#include <map>
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <iostream>
+
+using namespace std;
+
+static shared_guarded<shared_slot_map<long>> *objects;
+
+int main()
+{
+  global_shared_allocator::shm_open(NULL, O_RDWR | O_CREAT | O_TRUNC);
+  atexit(global_shared_allocator::shm_close);
+  global_shared_allocator::shm_unlink();
+
+  // Random operations against a reference.
+  shared_slot_map<long> m;
+  map<uint64_t, long> ref;
+  vector<uint64_t> stale;
+  srand(1);
+  for(int i = 0; i < 20000; ++i) {
+    if(ref.empty() || rand() % 3) {
+      uint64_t h = m.insert(i);
+      assert(h != m.null_handle && !ref.count(h));
+      ref[h] = i;
+    } else {
+      auto it = ref.begin();
+      advance(it, rand() % ref.size());
+      assert(m.erase(it->first));
+      assert(!m.erase(it->first));
+      stale.push_back(it->first);
+      ref.erase(it);
+    }
+  }
+  assert(m.size() == ref.size());
+  for(auto &p : ref) assert(m.at(p.first) == p.second);
+  for(uint64_t h : stale) assert(!m.get(h) && !m.contains(h));
+  for(auto it = m.begin(); it != m.end(); ++it) assert(ref.at(m.handle_of(it)) == *it);
+  assert(!m.contains(m.null_handle));
+  m.clear();
+  for(auto &p : ref) assert(!m.contains(p.first));
+
+  // Handles cross processes; stale ones are rejected there too.
+  objects = new(shared) shared_guarded<shared_slot_map<long>>();
+  uint64_t live = objects->write([](auto &s) { return s.insert(1); });
+  uint64_t dead = objects->write([](auto &s) { return s.insert(2); });
+  objects->write([&](auto &s) { s.erase(dead); s.insert(3); });
+  pid_t pid = fork();
+  if(pid < 0) err(EXIT_FAILURE, "fork");
+  if(pid == 0) {
+    objects->read([&](const auto &s) { assert(*s.get(live) == 1 && !s.get(dead)); });
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  cout << "passed" << endl;
+  return 0;
+}
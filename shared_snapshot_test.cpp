@@ -0,0 +1,106 @@
+#include "shared_allocator.h"
+#include "shared_container.h"
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <iostream>
+
+using namespace std;
+
+typedef shared_map<int, shared_string> map_t;
+static constexpr int n_item = 10000;
+static char path[64];
+
+// Readers cannot build shared strings, having no writable segment.
+static string value(int version, int i)
+{
+  return "version " + to_string(version) + " of a long enough key " + to_string(i);
+}
+
+static void check(const shared_snapshot &s, int version)
+{
+  const map_t *m = (const map_t *)s.root();
+  assert((int)m->size() == n_item);
+  for(int i = 0; i < n_item; ++i) assert(m->at(i) == value(version, i).c_str());
+}
+
+static shared_snapshot build(int version)
+{
+  global_shared_allocator::memfd_open("dataset");
+  map_t *m = new(shared) map_t;
+  for(int i = 0; i < n_item; ++i) m->emplace(i, value(version, i).c_str());
+  global_shared_allocator::set_root(m);
+  return global_shared_allocator::publish(path);
+}
+
+// A reader never attached to any writable segment: keep version 1 while swapping to 2.
+static void reader(int in)
+{
+  char c;
+  assert(read(in, &c, 1) == 1);
+  shared_snapshot s1(path);
+  check(s1, 1);
+  assert(read(in, &c, 1) == 1);
+  shared_snapshot s2(path);
+  check(s2, 2);
+  check(s1, 1);
+  s1 = std::move(s2);
+  check(s1, 2);
+}
+
+int main()
+{
+  snprintf(path, sizeof path, "/tmp/shared_snapshot_test.%d", (int)getpid());
+  int fds[2];
+  if(pipe(fds)) err(EXIT_FAILURE, "pipe");
+  pid_t pid = fork();
+  if(pid < 0) err(EXIT_FAILURE, "fork");
+  if(pid == 0) {
+    close(fds[1]);
+    reader(fds[0]);
+    _exit(0);
+  }
+  close(fds[0]);
+
+  shared_snapshot v1 = build(1);
+  assert(global_shared_allocator::shm_oflag() == 0);
+  check(v1, 1);
+  assert(write(fds[1], "1", 1) == 1);
+
+  // Sealed: neither writable mappings nor writes nor growth are possible.
+  assert(mmap(NULL, v1.size(), PROT_READ | PROT_WRITE, MAP_SHARED, v1.fd(), 0) == MAP_FAILED);
+  assert(pwrite(v1.fd(), "x", 1, 0) < 0);
+  assert(ftruncate(v1.fd(), v1.size() * 2) < 0);
+
+  // An unsealed descriptor is refused.
+  int fd = memfd_create("unsealed", MFD_CLOEXEC);
+  assert(ftruncate(fd, 1 << 20) == 0);
+  try {
+    shared_snapshot s(fd);
+    assert(false);
+  } catch(const runtime_error &) { }
+
+  shared_snapshot v2 = build(2);
+  assert(v2.addr() != v1.addr());
+  check(v2, 2);
+  check(v1, 1);
+  assert(write(fds[1], "2", 1) == 1);
+  int status;
+  assert(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  close(fds[1]);
+
+  // The link goes with the snapshot it refers to, and only with that one.
+  { shared_snapshot old = std::move(v1); }
+  assert(access(path, F_OK) == 0);
+  v2 = build(3);
+  assert(access(path, F_OK) == 0);
+  check(v2, 3);
+  { shared_snapshot last = std::move(v2); }
+  assert(access(path, F_OK) < 0);
+  cout << "passed" << endl;
+  return 0;
+}
@@ -0,0 +1,369 @@
+/*
+ * Process-shared synchronization primitives.
+ *
+ * Objects live in the shared memory, e.g. `new(shared) shared_event_count`.
+ * Linux futexes are used without FUTEX_PRIVATE_FLAG so that waiters in
+ * different processes meet at the same physical word.
+ *
+ * Written by <lyazj@github.com>.
+ */
+#pragma once
+#include "shared_allocator.h"
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t));
+static_assert(std::atomic<uint32_t>::is_always_lock_free);
+
+// Words touched by different processes are padded apart rather than aligned,
+// because the shared heap only guarantees 16-byte alignment.
+inline constexpr size_t shared_cache_line = 64;
+
+// Sleep while `word == expected`. Spurious returns are possible.
+inline void futex_wait(std::atomic<uint32_t> &word, uint32_t expected)
+{
+  syscall(SYS_futex, &word, FUTEX_WAIT, expected, NULL, NULL, 0);
+}
+
+// Wake at most `n` sleepers on `word`.
+inline void futex_wake(std::atomic<uint32_t> &word, int n = INT_MAX)
+{
+  syscall(SYS_futex, &word, FUTEX_WAKE, n, NULL, NULL, 0);
+}
+
+// A hint for busy-waiting loops.
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// Waiters block until a condition, checked by themselves, becomes true.
+// Notifiers pay a fence and a load unless somebody is actually sleeping.
+class shared_event_count {
+public:
+  shared_event_count() : seq_(0), waiters_(0) { }
+
+  // Call after making the condition true.
+  void notify()
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(waiters_.load(std::memory_order_relaxed) == 0) return;
+    seq_.fetch_add(1);
+    futex_wake(seq_);
+  }
+
+  // Spin for a while, then sleep until `ready()` returns true.
+  template<class F> void wait(F ready)
+  {
+    for(int i = 0; i < spin_; ++i) {
+      if(ready()) return;
+      cpu_relax();
+    }
+    waiters_.fetch_add(1);
+    for(;;) {
+      uint32_t seq = seq_.load();
+      if(ready()) break;
+      futex_wait(seq_, seq);
+    }
+    waiters_.fetch_sub(1);
+  }
+
+  // Two-phase waiting for conditions that are awkward to pass as a functor:
+  //   auto key = ec.prepare_wait();
+  //   if(ready) ec.cancel_wait(); else ec.commit_wait(key);
+  // Notifications after prepare_wait() are not missed.
+  uint32_t prepare_wait()
+  {
+    waiters_.fetch_add(1);
+    return seq_.load();
+  }
+  void commit_wait(uint32_t key)
+  {
+    futex_wait(seq_, key);
+    waiters_.fetch_sub(1);
+  }
+  void cancel_wait() { waiters_.fetch_sub(1); }
+
+private:
+  std::atomic<uint32_t> seq_;
+  std::atomic<uint32_t> waiters_;
+
+  static inline constexpr int spin_ = 128;
+};
+
+// Single-use countdown. Waiters are released when the count reaches zero.
+class shared_latch {
+public:
+  explicit shared_latch(uint32_t count) : count_(count), waiters_(0) { }
+  shared_latch(const shared_latch &) = delete;
+  shared_latch &operator=(const shared_latch &) = delete;
+
+  void count_down(uint32_t n = 1)
+  {
+    if(count_.fetch_sub(n) == n && waiters_.load()) futex_wake(count_);
+  }
+  bool try_wait() const { return count_.load(std::memory_order_acquire) == 0; }
+  void wait()
+  {
+    for(int i = 0; i < 128; ++i) {
+      if(try_wait()) return;
+      cpu_relax();
+    }
+    waiters_.fetch_add(1);
+    for(uint32_t c; (c = count_.load()) != 0;) futex_wait(count_, c);
+    waiters_.fetch_sub(1);
+  }
+  void arrive_and_wait(uint32_t n = 1)
+  {
+    count_down(n);
+    wait();
+  }
+
+private:
+  std::atomic<uint32_t> count_;
+  std::atomic<uint32_t> waiters_;
+};
+
+// Reusable barrier for a group of processes or threads going through phases.
+class shared_barrier {
+public:
+  explicit shared_barrier(uint32_t count) : state_((uint64_t)count << 32), dropped_(0), phase_(0), waiters_(0) { }
+  shared_barrier(const shared_barrier &) = delete;
+  shared_barrier &operator=(const shared_barrier &) = delete;
+
+  void arrive_and_wait()
+  {
+    uint32_t phase = phase_.load();
+    if(arrive()) return;
+    for(int i = 0; i < 128; ++i) {
+      if(phase_.load() != phase) return;
+      cpu_relax();
+    }
+    waiters_.fetch_add(1);
+    while(phase_.load() == phase) futex_wait(phase_, phase);
+    waiters_.fetch_sub(1);
+  }
+
+  // Arrive at the current phase and leave the group for the following ones.
+  void arrive_and_drop()
+  {
+    dropped_.fetch_add(1);
+    arrive();
+  }
+
+private:
+  std::atomic<uint64_t> state_;  // expected << 32 | arrived, for the current phase
+  std::atomic<uint32_t> dropped_;  // leave at the end of the current phase
+  std::atomic<uint32_t> phase_;
+  std::atomic<uint32_t> waiters_;
+
+  // True if this arrival completed the phase.
+  bool arrive()
+  {
+    uint64_t s = state_.fetch_add(1) + 1;
+    uint32_t expected = s >> 32;
+    if((uint32_t)s != expected) return false;
+    state_.store((uint64_t)(expected - dropped_.exchange(0)) << 32);
+    phase_.fetch_add(1);
+    if(waiters_.load()) futex_wake(phase_);
+    return true;
+  }
+};
+
+// Test-and-test-and-set lock for short critical sections. Meets Lockable.
+class shared_spinlock {
+public:
+  shared_spinlock() : locked_(0) { }
+  shared_spinlock(const shared_spinlock &) = delete;
+  shared_spinlock &operator=(const shared_spinlock &) = delete;
+
+  void lock()
+  {
+    while(locked_.exchange(1, std::memory_order_acquire)) {
+      for(int i = 0; locked_.load(std::memory_order_relaxed); ++i) {
+        if(i < 1024) cpu_relax(); else sched_yield();
+      }
+    }
+  }
+  bool try_lock()
+  {
+    return !locked_.load(std::memory_order_relaxed) && !locked_.exchange(1, std::memory_order_acquire);
+  }
+  void unlock() { locked_.store(0, std::memory_order_release); }
+
+private:
+  std::atomic<uint32_t> locked_;
+};
+
+// Writer-preferring reader-writer lock. Meets SharedLockable.
+// New readers wait as soon as a writer is waiting, so writers never starve.
+class shared_rwlock {
+public:
+  shared_rwlock() : state_(0), writers_(0), seq_(0), sleepers_(0) { }
+  shared_rwlock(const shared_rwlock &) = delete;
+  shared_rwlock &operator=(const shared_rwlock &) = delete;
+
+  void lock()
+  {
+    writers_.fetch_add(1);
+    wait([this](uint32_t s) { return s == 0 && state_.compare_exchange_strong(s, writer_); });
+    writers_.fetch_sub(1);
+  }
+  bool try_lock()
+  {
+    uint32_t s = 0;
+    return state_.compare_exchange_strong(s, writer_);
+  }
+  void unlock()
+  {
+    state_.store(0);
+    wake();
+  }
+
+  void lock_shared()
+  {
+    wait([this](uint32_t s) { return try_lock_shared(s); });
+  }
+  bool try_lock_shared() { return try_lock_shared(state_.load()); }
+  void unlock_shared()
+  {
+    if(state_.fetch_sub(1) == 1 && writers_.load()) wake();
+  }
+
+private:
+  static inline constexpr uint32_t writer_ = 1u << 31;
+
+  std::atomic<uint32_t> state_;  // writer_ or #readers
+  std::atomic<uint32_t> writers_;  // waiting or holding
+  std::atomic<uint32_t> seq_;  // bumped by wake(); sleepers wait on it, not on state_
+  std::atomic<uint32_t> sleepers_;
+
+  // Only fails for writers, which wake us; losing to other readers is retried.
+  bool try_lock_shared(uint32_t s)
+  {
+    while(!(s & writer_) && writers_.load() == 0) {
+      if(state_.compare_exchange_weak(s, s + 1)) return true;
+    }
+    return false;
+  }
+
+  // Spin for a while, then sleep until acquire(state) succeeds. state_ may go through
+  // the value we saw and back (e.g. a writer locking and unlocking), so sleep on seq_.
+  template<class F> void wait(F acquire)
+  {
+    for(int i = 0; i < 128; ++i) {
+      if(acquire(state_.load())) return;
+      cpu_relax();
+    }
+    sleepers_.fetch_add(1);
+    for(;;) {
+      uint32_t seq = seq_.load();
+      if(acquire(state_.load())) break;
+      futex_wait(seq_, seq);
+    }
+    sleepers_.fetch_sub(1);
+  }
+
+  void wake()
+  {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(sleepers_.load(std::memory_order_relaxed) == 0) return;
+    seq_.fetch_add(1);
+    futex_wake(seq_);
+  }
+};
+
+// Sequence lock for small trivially copyable records.
+// Readers never write shared memory and retry if a writer interleaved.
+template<class T>
+class shared_seqlock {
+  static_assert(std::is_trivially_copyable_v<T>);
+
+public:
+  shared_seqlock() : seq_(0), value_() { }
+  explicit shared_seqlock(const T &v) : seq_(0), value_(v) { }
+
+  T load() const
+  {
+    T v;
+    for(;;) {
+      uint32_t s = seq_.load(std::memory_order_acquire);
+      if(s & 1) { cpu_relax(); continue; }
+      memcpy(&v, (const void *)&value_, sizeof v);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if(seq_.load(std::memory_order_relaxed) == s) return v;
+    }
+  }
+
+  // Writers are serialized by the odd sequence number.
+  void store(const T &v)
+  {
+    uint32_t s = seq_.load(std::memory_order_relaxed);
+    for(;;) {
+      if(!(s & 1) && seq_.compare_exchange_weak(s, s + 1, std::memory_order_acquire)) break;
+      cpu_relax();
+      s = seq_.load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy((void *)&value_, &v, sizeof v);
+    seq_.store(s + 2, std::memory_order_release);
+  }
+
+private:
+  std::atomic<uint32_t> seq_;
+  T value_;
+};
+
+// A value bundled with its lock, both in the shared memory.
+// read() takes a shared lock when Lock supports one.
+template<class T, class Lock = shared_rwlock>
+class shared_guarded {
+public:
+  template<class... Args> explicit shared_guarded(Args &&...args) : value_(std::forward<Args>(args)...) { }
+  shared_guarded(const shared_guarded &) = delete;
+  shared_guarded &operator=(const shared_guarded &) = delete;
+
+  template<class F> decltype(auto) write(F f)
+  {
+    std::lock_guard<Lock> l(lock_);
+    return f(value_);
+  }
+
+  template<class F> decltype(auto) read(F f) const
+  {
+    if constexpr(has_shared_lock<Lock>::value) {
+      lock_.lock_shared();
+      struct unlock { Lock &l; ~unlock() { l.unlock_shared(); } } u{lock_};
+      return f((const T &)value_);
+    } else {
+      std::lock_guard<Lock> l(lock_);
+      return f((const T &)value_);
+    }
+  }
+
+  // For callers managing the lock themselves.
+  Lock &mutex() const { return lock_; }
+  T &unsafe_get() { return value_; }
+
+private:
+  template<class L, class = void> struct has_shared_lock : std::false_type { };
+  template<class L> struct has_shared_lock<L, std::void_t<decltype(std::declval<L &>().lock_shared())>> : std::true_type { };
+
+  mutable Lock lock_;
+  T value_;
+};
@@ -0,0 +1,146 @@
+#include "shared_sync.h"
+#include "shared_container.h"
+#include <assert.h>
+#include <unistd.h>
+#include <err.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <iostream>
+
+using namespace std;
+
+static constexpr int n_proc = 6, n_iter = 20000;
+
+struct record {
+  long a, b;  // b == -a always
+};
+
+static shared_guarded<shared_map<int, int>> *g;
+static shared_seqlock<record> *seq;
+
+static constexpr int n_phase = 2000;
+static shared_barrier *barrier;
+static shared_latch *latch;
+static shared_event_count *ec;
+static atomic<int> *slots, *flag;
+
+static void work(int p)
+{
+  for(int i = 0; i < n_iter; ++i) {
+    if(p % 3 == 0) {
+      // Writers insert keys in pairs.
+      g->write([&](shared_map<int, int> &m) {
+        m[2 * (p * n_iter + i)];
+        m[2 * (p * n_iter + i) + 1];
+      });
+    } else {
+      g->read([](const shared_map<int, int> &m) {
+        assert(m.size() % 2 == 0);
+      });
+    }
+    if(p == 1) {
+      seq->store({i, -i});
+    } else {
+      record r = seq->load();
+      assert(r.a == -r.b);
+    }
+  }
+}
+
+int main()
+{
+  global_shared_allocator::shm_open(NULL, O_RDWR | O_CREAT | O_TRUNC);
+  atexit(global_shared_allocator::shm_close);
+  global_shared_allocator::shm_unlink();
+  g = new(shared) shared_guarded<shared_map<int, int>>;
+  seq = new(shared) shared_seqlock<record>;
+
+  for(int p = 0; p < n_proc; ++p) {
+    pid_t pid = fork();
+    if(pid < 0) err(EXIT_FAILURE, "fork");
+    if(pid == 0) {
+      work(p);
+      _exit(0);
+    }
+  }
+  int status;
+  while(wait(&status) > 0) assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  assert(g->read([](const shared_map<int, int> &m) { return m.size(); }) == (size_t)(n_proc / 3 * n_iter * 2));
+  assert(seq->load().a == n_iter - 1);
+  shared_rwlock &l = g->mutex();
+  assert(l.try_lock_shared() && l.try_lock_shared() && !l.try_lock());
+  l.unlock_shared();
+  l.unlock_shared();
+  assert(l.try_lock() && !l.try_lock_shared());
+  l.unlock();
+
+  // Readers blocked only by a waiting writer, which locks and unlocks once, must all get in.
+  alarm(60);
+  for(int round = 0; round < 300; ++round) {
+    l.lock_shared();
+    for(int p = 0; p < 4; ++p) {
+      pid_t pid = fork();
+      if(pid < 0) err(EXIT_FAILURE, "fork");
+      if(pid) continue;
+      if(p == 0) {
+        l.lock();
+        l.unlock();
+      } else {
+        usleep(round % 10 * 100);
+        l.lock_shared();
+        l.unlock_shared();
+      }
+      _exit(0);
+    }
+    usleep(round % 7 * 100);
+    l.unlock_shared();
+    while(wait(&status) > 0) assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+  alarm(0);
+
+  // Phases: everybody sees everybody's writes of the current phase. One process drops out halfway.
+  barrier = new(shared) shared_barrier(n_proc);
+  latch = new(shared) shared_latch(n_proc);
+  slots = new(shared) atomic<int>[n_proc];
+  for(int p = 0; p < n_proc; ++p) slots[p] = -1;
+  for(int p = 0; p < n_proc; ++p) {
+    pid_t pid = fork();
+    if(pid < 0) err(EXIT_FAILURE, "fork");
+    if(pid) continue;
+    latch->arrive_and_wait();
+    for(int i = 0; i < n_phase; ++i) {
+      if(p == 0 && i == n_phase / 2) {
+        barrier->arrive_and_drop();
+        _exit(0);
+      }
+      slots[p].store(i);
+      barrier->arrive_and_wait();
+      for(int q = 1; q < n_proc; ++q) assert(slots[q].load() == i);
+      barrier->arrive_and_wait();
+    }
+    _exit(0);
+  }
+  while(wait(&status) > 0) assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  assert(latch->try_wait());
+
+  // Two-phase event count waiting.
+  ec = new(shared) shared_event_count;
+  flag = new(shared) atomic<int>(0);
+  pid_t pid = fork();
+  if(pid == 0) {
+    for(;;) {
+      uint32_t key = ec->prepare_wait();
+      if(flag->load()) { ec->cancel_wait(); break; }
+      ec->commit_wait(key);
+    }
+    _exit(0);
+  }
+  usleep(10000);
+  flag->store(1);
+  ec->notify();
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  cout << "passed" << endl;
+  return 0;
+}